@@ -0,0 +1,527 @@
+/// image1bit - Bit-packed binary images.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "image1bit.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "instrumentation.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Internal structure for storing bitmaps.
+// Each row takes wpr 64-bit words: pixel x of row y is bit x%64 (counting
+// from the least significant) of word[y*wpr + x/64].
+// The bits after the last pixel of each row are always 0, so that bitwise
+// operations and counts may work on whole words.
+struct bitmap {
+  int width;
+  int height;
+  int wpr;          // words per row
+  uint64_t* word;   // rows of bits
+};
+
+// The counters of image8bit (named by ImageInit).
+// Bitmap operations count memory accesses per 64-bit word, and pixel
+// operations per word too, as that is what they work on.
+#define PIXMEM InstrCounter(0)
+#define PIXOPS InstrCounter(1)
+
+// Address of the words of row y.
+static inline uint64_t* RowPtr(Bitmap bm, int y) {
+  return bm->word + (size_t)y*bm->wpr;
+}
+
+// Mask of the bits of the last word of a row that hold pixels.
+static inline uint64_t LastMask(int width) {
+  return width % 64 == 0 ? ~0ull : (1ull << (width % 64)) - 1;
+}
+
+// Number of words in bm.
+static inline unsigned long Words(Bitmap bm) {
+  return (unsigned long)bm->wpr*bm->height;
+}
+
+
+/// Error handling functions
+
+// As in image8bit, functions that deal with memory allocation or files
+// signal failure by returning an error value, and set errCause (with
+// check) and errno.
+
+// Variable to preserve errno temporarily
+static __thread int errsave = 0;
+
+// Error cause
+static __thread char* errCause;
+
+/// Error cause.
+/// After some other module function fails, returns a message describing the
+/// failure cause (see ImageErrMsg).
+char* BitmapErrMsg() { ///
+  return errCause;
+}
+
+// Check a condition and set errCause to failmsg in case of failure.
+// Propagates the condition.
+// Preserves global errno!
+static int check(int condition, const char* failmsg) {
+  errCause = (char*)(condition ? "" : failmsg);
+  return condition;
+}
+
+
+/// Bitmap management
+
+/// Create a new black bitmap.
+///   width, height : the dimensions of the new bitmap.
+/// Requires: width and height must be non-negative.
+///
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapCreate(int width, int height) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  Bitmap bm = NULL;
+  if (!check( (bm = (Bitmap)malloc(sizeof(*bm))) != NULL, "Alloc bitmap failed" )) {
+    return NULL;
+  }
+  bm->width = width;
+  bm->height = height;
+  bm->wpr = (width + 63) / 64;
+  // (+ 1, so that calloc does not return NULL for empty bitmaps)
+  if (!check( (bm->word = (uint64_t*)calloc(Words(bm) + 1, sizeof(uint64_t))) != NULL, "Alloc bitmap failed" )) {
+    free(bm);
+    return NULL;
+  }
+  return bm;
+}
+
+/// Destroy the bitmap pointed to by (*pbm).
+///   pbm : address of a Bitmap variable.
+/// If (*pbm)==NULL, no operation is performed.
+/// Ensures: (*pbm)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void BitmapDestroy(Bitmap* pbm) { ///
+  assert (pbm != NULL);
+  if (*pbm != NULL) {
+    free((*pbm)->word);
+  }
+  free(*pbm);
+  *pbm = NULL;
+}
+
+
+/// PBM file operations
+
+// See also:
+// PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
+// In a raw PBM file, each row takes (width+7)/8 bytes, with the first
+// pixel of each byte in its most significant bit, and 1 means black.
+
+// Match and skip 0 or more comment lines in file f.
+// Comments start with a # and continue until the end-of-line, inclusive.
+// Returns the number of comments skipped.
+static int skipComments(FILE* f) {
+  char c;
+  int i = 0;
+  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
+    i++;
+  }
+  return i;
+}
+
+// Read a raw PBM file header.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int readHeader(FILE* f, int* w, int* h) {
+  char c;
+  return
+  check( fscanf(f, "P%c ", &c) == 1 && c == '4' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", w) == 1 && *w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", h) == 1 && *h >= 0 , "Invalid height" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+}
+
+// Reverse the order of the bits of byte b.
+static inline uint8 Reverse(uint8 b) {
+  return (uint8)(((b * 0x0202020202ull) & 0x010884422010ull) % 1023);
+}
+
+// Set row to the pixels of the n file bytes at bytes.
+static void RowFromFile(uint64_t* row, int wpr, const uint8* bytes, size_t n) {
+  for (int i = 0; i < wpr; i++) {
+    uint64_t word = 0;
+    for (size_t k = 0; k < 8 && 8*(size_t)i + k < n; k++) {
+      word |= (uint64_t)(uint8)~Reverse(bytes[8*(size_t)i + k]) << (8*k);
+    }
+    row[i] = word;
+  }
+}
+
+// Set the n file bytes at bytes to the pixels of row.
+static void RowToFile(const uint64_t* row, uint8* bytes, size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    bytes[k] = (uint8)~Reverse((uint8)(row[k/8] >> (8*(k%8))));
+  }
+}
+
+/// Load a raw PBM file (P4).
+/// (Black pixels are 1 in the file, and 0 in the bitmap.)
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapLoad(const char* filename) { ///
+  int w, h;
+  FILE* f = NULL;
+  Bitmap bm = NULL;
+  uint8* bytes = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  // Parse PBM header
+  readHeader(f, &w, &h) &&
+  // Allocate bitmap and row buffer
+  (bm = BitmapCreate(w, h)) != NULL &&
+  check( (bytes = (uint8*)malloc((size_t)bm->wpr*8 + 1)) != NULL, "Alloc bitmap failed" );
+  // Read pixels
+  size_t n = ((size_t)w + 7) / 8;
+  uint64_t last = LastMask(w);
+  for (int y = 0; success && y < h; y++) {
+    success = check( fread(bytes, 1, n, f) == n, "Reading pixels" );
+    uint64_t* row = RowPtr(bm, y);
+    RowFromFile(row, bm->wpr, bytes, n);
+    if (bm->wpr > 0) row[bm->wpr-1] &= last;  // the padding bits were 0 (black)
+  }
+  if (bm != NULL) PIXMEM += Words(bm);
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    BitmapDestroy(&bm);
+    errno = errsave;
+  }
+  free(bytes);
+  if (f != NULL) fclose(f);
+  return bm;
+}
+
+/// Save bitmap to PBM file.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitmapSave(Bitmap bm, const char* filename) { ///
+  assert (bm != NULL);
+  int w = bm->width;
+  int h = bm->height;
+  size_t n = ((size_t)w + 7) / 8;
+  FILE* f = NULL;
+  uint8* bytes = NULL;
+
+  int success =
+  check( (bytes = (uint8*)malloc(n + 1)) != NULL, "Alloc bitmap failed" ) &&
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed" );
+  for (int y = 0; success && y < h; y++) {
+    RowToFile(RowPtr(bm, y), bytes, n);
+    if (w % 8 != 0) bytes[n-1] &= (uint8)(0xff00 >> (w % 8));  // padding bits 0
+    success = check( fwrite(bytes, 1, n, f) == n, "Writing pixels failed" );
+  }
+  PIXMEM += Words(bm);
+
+  // Cleanup
+  if (f != NULL) fclose(f);
+  free(bytes);
+  return success;
+}
+
+
+/// Information queries
+
+/// These functions do not modify the bitmap and never fail.
+
+/// Get bitmap width
+int BitmapWidth(Bitmap bm) { ///
+  assert (bm != NULL);
+  return bm->width;
+}
+
+/// Get bitmap height
+int BitmapHeight(Bitmap bm) { ///
+  assert (bm != NULL);
+  return bm->height;
+}
+
+/// Check if pixel position (x,y) is inside bm.
+int BitmapValidPos(Bitmap bm, int x, int y) { ///
+  assert (bm != NULL);
+  return (0 <= x && x < bm->width) && (0 <= y && y < bm->height);
+}
+
+/// Check if rectangular area (x,y,w,h) is completely inside bm.
+int BitmapValidRect(Bitmap bm, int x, int y, int w, int h) { ///
+  assert (bm != NULL);
+  return BitmapValidPos(bm, x, y) && BitmapValidPos(bm, x+w-1, y+h-1);
+}
+
+/// Number of white pixels (bits 1).
+uint64_t BitmapArea(Bitmap bm) { ///
+  assert (bm != NULL);
+  uint64_t area = 0;
+  unsigned long n = Words(bm);
+  for (unsigned long i = 0; i < n; i++) {
+    area += (uint64_t)__builtin_popcountll(bm->word[i]);
+  }
+  PIXMEM += n;
+  PIXOPS += n;
+  return area;
+}
+
+
+/// Pixel get & set operations
+
+/// Get the bit at position (x,y).
+int BitmapGetBit(Bitmap bm, int x, int y) { ///
+  assert (bm != NULL);
+  assert (BitmapValidPos(bm, x, y));
+  PIXMEM += 1;
+  return (int)(RowPtr(bm, y)[x/64] >> (x%64)) & 1;
+}
+
+/// Set the bit at position (x,y) to bit (0 or nonzero).
+void BitmapSetBit(Bitmap bm, int x, int y, int bit) { ///
+  assert (bm != NULL);
+  assert (BitmapValidPos(bm, x, y));
+  PIXMEM += 1;
+  uint64_t* word = &RowPtr(bm, y)[x/64];
+  uint64_t mask = 1ull << (x%64);
+  *word = bit ? *word | mask : *word & ~mask;
+}
+
+
+/// Conversions
+
+// Bits of the w <= 64 pixels at p that are >= thr.
+static inline uint64_t PackWord(const uint8* p, int w, uint8 thr) {
+  uint64_t word = 0;
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i t = _mm_set1_epi8((char)thr);
+  for (; i + 16 <= w; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+    // v >= t  <=>  max(v, t) == v  (unsigned)
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, t), v);
+    word |= (uint64_t)(unsigned)_mm_movemask_epi8(ge) << i;
+  }
+#endif
+  for (; i < w; i++) {
+    word |= (uint64_t)(p[i] >= thr) << i;
+  }
+  return word;
+}
+
+// Set the w <= 64 pixels at p to maxval or 0, from the bits of word.
+static inline void UnpackWord(uint64_t word, uint8* p, int w, uint8 maxval) {
+  int i = 0;
+#ifdef __SSE2__
+  // Byte k of each half selects bit k (of the byte of word it holds).
+  const __m128i sel = _mm_set1_epi64x((long long)0x8040201008040201ull);
+  const __m128i white = _mm_set1_epi8((char)maxval);
+  for (; i + 16 <= w; i += 16) {
+    uint64_t lo = (word >> i) & 0xff;
+    uint64_t hi = (word >> (i+8)) & 0xff;
+    __m128i v = _mm_set_epi64x((long long)(hi * 0x0101010101010101ull),
+                               (long long)(lo * 0x0101010101010101ull));
+    __m128i set = _mm_cmpeq_epi8(_mm_and_si128(v, sel), sel);
+    _mm_storeu_si128((__m128i*)(p + i), _mm_and_si128(set, white));
+  }
+#endif
+  for (; i < w; i++) {
+    p[i] = (word >> i) & 1 ? maxval : 0;
+  }
+}
+
+/// Threshold an 8-bit image into a new bitmap.
+/// Pixels with level >= thr are white (bit 1), the others black (bit 0),
+/// the same as ImageThreshold(img, thr) does with 8 bits per pixel.
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapFromImage(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  Bitmap bm = BitmapCreate(w, h);
+  if (bm == NULL) return NULL;
+  for (int y = 0; y < h; y++) {
+    const uint8* p = ImageRow(img, y);
+    uint64_t* row = RowPtr(bm, y);
+    for (int i = 0; i < bm->wpr; i++) {
+      row[i] = PackWord(p + 64*i, w - 64*i < 64 ? w - 64*i : 64, thr);
+    }
+  }
+  PIXMEM += (unsigned long)w*h + Words(bm);  // pixels read + words written
+  PIXOPS += (unsigned long)w*h;              // 1 comparison per pixel
+  return bm;
+}
+
+/// Convert a bitmap to a new 8-bit image, with white pixels at maxval
+/// and black pixels at 0.  So converting the bitmap of
+/// BitmapFromImage(img, thr) with the maxval of img gives the same image
+/// as ImageThreshold(img, thr).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause (of image8bit) are set
+/// accordingly.
+Image BitmapToImage(Bitmap bm, uint8 maxval) { ///
+  assert (bm != NULL);
+  assert (0 < maxval && maxval <= PixMax);
+  int w = bm->width;
+  int h = bm->height;
+  Image img = ImageCreate(w, h, maxval);
+  uint8* buf = NULL;
+  if (img == NULL) return NULL;
+  if (!check( (buf = (uint8*)malloc((size_t)w + 1)) != NULL, "Alloc row failed" )) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+    return NULL;
+  }
+  for (int y = 0; y < h; y++) {
+    const uint64_t* row = RowPtr(bm, y);
+    for (int i = 0; i < bm->wpr; i++) {
+      UnpackWord(row[i], buf + 64*i, w - 64*i < 64 ? w - 64*i : 64, maxval);
+    }
+    ImageSetRow(img, y, buf);
+  }
+  free(buf);
+  PIXMEM += Words(bm);
+  PIXOPS += (unsigned long)w*h;  // 1 selection per pixel
+  return img;
+}
+
+
+/// Bitwise operations
+
+/// These functions modify bm1 (or bm) in-place, and never fail.
+/// Requires: bm1 and bm2 have the same size.
+
+// Size precondition of the binary operations.
+static inline int SameSize(Bitmap bm1, Bitmap bm2) {
+  return bm1->width == bm2->width && bm1->height == bm2->height;
+}
+
+/// bm1 = bm1 AND bm2 (white where both are white).
+void BitmapAnd(Bitmap bm1, Bitmap bm2) { ///
+  assert (bm1 != NULL && bm2 != NULL);
+  assert (SameSize(bm1, bm2));
+  unsigned long n = Words(bm1);
+  for (unsigned long i = 0; i < n; i++) bm1->word[i] &= bm2->word[i];
+  PIXMEM += 3*n;
+  PIXOPS += n;
+}
+
+/// bm1 = bm1 OR bm2 (white where either is white).
+void BitmapOr(Bitmap bm1, Bitmap bm2) { ///
+  assert (bm1 != NULL && bm2 != NULL);
+  assert (SameSize(bm1, bm2));
+  unsigned long n = Words(bm1);
+  for (unsigned long i = 0; i < n; i++) bm1->word[i] |= bm2->word[i];
+  PIXMEM += 3*n;
+  PIXOPS += n;
+}
+
+/// bm1 = bm1 XOR bm2 (white where they differ).
+void BitmapXor(Bitmap bm1, Bitmap bm2) { ///
+  assert (bm1 != NULL && bm2 != NULL);
+  assert (SameSize(bm1, bm2));
+  unsigned long n = Words(bm1);
+  for (unsigned long i = 0; i < n; i++) bm1->word[i] ^= bm2->word[i];
+  PIXMEM += 3*n;
+  PIXOPS += n;
+}
+
+/// bm = NOT bm (swap white and black).
+void BitmapNot(Bitmap bm) { ///
+  assert (bm != NULL);
+  uint64_t last = LastMask(bm->width);
+  for (int y = 0; y < bm->height; y++) {
+    uint64_t* row = RowPtr(bm, y);
+    for (int i = 0; i < bm->wpr; i++) row[i] = ~row[i];
+    if (bm->wpr > 0) row[bm->wpr-1] &= last;  // keep the padding bits 0
+  }
+  PIXMEM += 2*Words(bm);
+  PIXOPS += Words(bm);
+}
+
+
+/// Geometric operations
+
+// The 64 bits of row (of wpr words) from bit x (0 beyond the row).
+static inline uint64_t Bits(const uint64_t* row, int wpr, int x) {
+  int i = x / 64;
+  int s = x % 64;
+  uint64_t bits = i < wpr ? row[i] >> s : 0;
+  if (s > 0 && i+1 < wpr) bits |= row[i+1] << (64 - s);
+  return bits;
+}
+
+/// Crop a rectangular subbitmap from bm.
+/// The rectangle is specified by the top left corner coords (x, y) and
+/// width w and height h.
+/// Requires:
+///   The rectangle must be inside the original bitmap.
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapCrop(Bitmap bm, int x, int y, int w, int h) { ///
+  assert (bm != NULL);
+  assert (BitmapValidRect(bm, x, y, w, h));
+  Bitmap crop = BitmapCreate(w, h);
+  if (crop == NULL) return NULL;
+  uint64_t last = LastMask(w);
+  for (int j = 0; j < h; j++) {
+    const uint64_t* src = RowPtr(bm, y+j);
+    uint64_t* dst = RowPtr(crop, j);
+    for (int i = 0; i < crop->wpr; i++) {
+      dst[i] = Bits(src, bm->wpr, x + 64*i);
+    }
+    if (crop->wpr > 0) dst[crop->wpr-1] &= last;
+  }
+  PIXMEM += 3*Words(crop);  // 2 reads + 1 write per word
+  PIXOPS += Words(crop);
+  return crop;
+}
+
+/// Paste bm2 into bm1 at position (x, y).
+/// Requires: bm2 must fit inside bm1 at position (x, y).
+void BitmapPaste(Bitmap bm1, int x, int y, Bitmap bm2) { ///
+  assert (bm1 != NULL);
+  assert (bm2 != NULL);
+  assert (BitmapValidRect(bm1, x, y, bm2->width, bm2->height));
+  int s = x % 64;
+  for (int j = 0; j < bm2->height; j++) {
+    const uint64_t* src = RowPtr(bm2, j);
+    uint64_t* dst = RowPtr(bm1, y+j) + x/64;
+    for (int i = 0; i < bm2->wpr; i++) {
+      // Word i of bm2 goes to bits [s, s+64) of dst[i], dst[i+1].
+      uint64_t mask = i+1 < bm2->wpr ? ~0ull : LastMask(bm2->width);
+      dst[i] = (dst[i] & ~(mask << s)) | (src[i] << s);
+      if (s > 0 && (mask >> (64 - s)) != 0) {
+        dst[i+1] = (dst[i+1] & ~(mask >> (64 - s))) | (src[i] >> (64 - s));
+      }
+    }
+  }
+  PIXMEM += 4*Words(bm2);  // 1 read + (1 read + 1 write) per word, about
+  PIXOPS += Words(bm2);
+}
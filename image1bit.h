@@ -0,0 +1,137 @@
+/// image1bit - Bit-packed binary images.
+///
+/// This module complements image8bit with binary images (bitmaps), such as
+/// the masks that result from thresholding, stored with 1 bit per pixel.
+/// Bit 1 is white (the pixels at or above the threshold) and bit 0 is
+/// black.  Operations work on 64 pixels at a time.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#ifndef IMAGE1BIT_H
+#define IMAGE1BIT_H
+
+#include <inttypes.h>
+#include "image8bit.h"
+
+// Type Bitmap is a pointer to bitmap objects
+typedef struct bitmap *Bitmap;
+
+/// Error messages
+
+/// After some module function fails, returns a message describing the
+/// failure cause (see ImageErrMsg).
+char* BitmapErrMsg() ;
+
+/// Bitmap management
+
+/// Create a new black bitmap.
+///   width, height : the dimensions of the new bitmap.
+/// Requires: width and height must be non-negative.
+///
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapCreate(int width, int height) ;
+
+/// Destroy the bitmap pointed to by (*pbm).
+///   pbm : address of a Bitmap variable.
+/// If (*pbm)==NULL, no operation is performed.
+/// Ensures: (*pbm)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void BitmapDestroy(Bitmap* pbm) ;
+
+/// PBM file operations
+
+/// Load a raw PBM file (P4).
+/// (Black pixels are 1 in the file, and 0 in the bitmap.)
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapLoad(const char* filename) ;
+
+/// Save bitmap to PBM file.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitmapSave(Bitmap bm, const char* filename) ;
+
+/// Information queries
+
+/// Get bitmap width
+int BitmapWidth(Bitmap bm) ;
+
+/// Get bitmap height
+int BitmapHeight(Bitmap bm) ;
+
+/// Check if pixel position (x,y) is inside bm.
+int BitmapValidPos(Bitmap bm, int x, int y) ;
+
+/// Check if rectangular area (x,y,w,h) is completely inside bm.
+int BitmapValidRect(Bitmap bm, int x, int y, int w, int h) ;
+
+/// Number of white pixels (bits 1).
+uint64_t BitmapArea(Bitmap bm) ;
+
+/// Pixel get & set operations
+
+/// Get the bit at position (x,y).
+int BitmapGetBit(Bitmap bm, int x, int y) ;
+
+/// Set the bit at position (x,y) to bit (0 or nonzero).
+void BitmapSetBit(Bitmap bm, int x, int y, int bit) ;
+
+/// Conversions
+
+/// Threshold an 8-bit image into a new bitmap.
+/// Pixels with level >= thr are white (bit 1), the others black (bit 0),
+/// the same as ImageThreshold(img, thr) does with 8 bits per pixel.
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapFromImage(Image img, uint8 thr) ;
+
+/// Convert a bitmap to a new 8-bit image, with white pixels at maxval
+/// and black pixels at 0.  So converting the bitmap of
+/// BitmapFromImage(img, thr) with the maxval of img gives the same image
+/// as ImageThreshold(img, thr).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause (of image8bit) are set
+/// accordingly.
+Image BitmapToImage(Bitmap bm, uint8 maxval) ;
+
+/// Bitwise operations
+
+/// These functions modify bm1 (or bm) in-place, and never fail.
+/// Requires: bm1 and bm2 have the same size.
+
+/// bm1 = bm1 AND bm2 (white where both are white).
+void BitmapAnd(Bitmap bm1, Bitmap bm2) ;
+
+/// bm1 = bm1 OR bm2 (white where either is white).
+void BitmapOr(Bitmap bm1, Bitmap bm2) ;
+
+/// bm1 = bm1 XOR bm2 (white where they differ).
+void BitmapXor(Bitmap bm1, Bitmap bm2) ;
+
+/// bm = NOT bm (swap white and black).
+void BitmapNot(Bitmap bm) ;
+
+/// Geometric operations
+
+/// Crop a rectangular subbitmap from bm.
+/// The rectangle is specified by the top left corner coords (x, y) and
+/// width w and height h.
+/// Requires:
+///   The rectangle must be inside the original bitmap.
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapCrop(Bitmap bm, int x, int y, int w, int h) ;
+
+/// Paste bm2 into bm1 at position (x, y).
+/// Requires: bm2 must fit inside bm1 at position (x, y).
+void BitmapPaste(Bitmap bm1, int x, int y, Bitmap bm2) ;
+
+#endif
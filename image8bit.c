@@ -22,10 +22,29 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "instrumentation.h"
 
+// SIMD kernels use SSE2 when the compiler targets it (always on x86-64).
+// AVX2 kernels are compiled for x86 with GCC-compatible compilers, and
+// selected at run time, when the CPU supports them.
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TARGET_AVX2 1
+#endif
+
 // The data structure
 //
 // An image is stored in a structure containing 3 fields:
@@ -37,6 +56,11 @@
 // For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//
+// Consecutive rows start img->stride pixels apart.  In images created or
+// loaded, the stride is the width.  A view (see ImageCreateView) shares
+// the pixels of a rectangle of another image, so its stride is that of
+// the other image, and its rows are not contiguous in general.
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -51,8 +75,36 @@ struct image {
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
   uint8* pixel; // pixel data (a raster scan)
+  int stride;   // distance between rows in pixel (>= width)
+  int view;     // do pixels belong to another image?
+  size_t bufsize; // size of the pixel buffer (if allocated)
+  void* map;    // file mapping holding the pixels (NULL if allocated)
+  size_t mapsize; // length of the file mapping
+  Image owner;  // image that owns the pixels of a view (NULL if not a view)
+  ImageHist* hist; // cached statistics (NULL if never computed)
+  int histValid;   // are the cached statistics up to date?
+  struct pyramid* pyr; // cached search pyramid (NULL if never built)
+  int pyrValid;    // is the cached pyramid up to date?
 };
 
+// Address of pixel (x, y).
+static inline uint8* PixelPtr(Image img, int x, int y) {
+  return img->pixel + (ptrdiff_t)y*img->stride + x;
+}
+
+// Are the rows of img contiguous (so that pixels are a single array)?
+static inline int Contiguous(Image img) {
+  return img->stride == img->width || img->height <= 1;
+}
+
+// Note that the pixels of img are being modified: invalidate cached
+// statistics.  (Views have none, but the image that owns their pixels may.)
+static inline void Modified(Image img) {
+  Image owner = img->owner != NULL ? img->owner : img;
+  owner->histValid = 0;
+  owner->pyrValid = 0;
+}
+
 
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
@@ -74,10 +126,11 @@ struct image {
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static __thread int errsave = 0;
 
 // Error cause
-static char* errCause;
+// (Like errno, it is per thread, so that threads may use images concurrently.)
+static __thread char* errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -144,7 +197,7 @@ static int check(int condition, const char* failmsg) {
 /// Init Image library.  (Call once!)
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void) { ///
-  InstrCalibrate();
+  InstrCalibrateLazy();  // calibrate only if times are printed
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   // Name other counters here...
   //HIDE
@@ -154,40 +207,238 @@ void ImageInit(void) { ///
 }
 
 // Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
+#define PIXMEM InstrCounter(0)
 // Add more macros here...
 //HIDE
-#define PIXOPS InstrCount[1]
+#define PIXOPS InstrCounter(1)
 //SHOW
 
+// (See instrumentation.h for counting modes, such as INSTR_OFF.)
+
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
 
-/// Image management functions
+/// Threads
 
-/// Create a new black image.
-///   width, height : the dimensions of the new image.
-///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
-/// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) { ///
-  assert (width >= 0);
-  assert (height >= 0);
-  assert (0 < maxval && maxval <= PixMax);
-  // Insert your code here!
+/// Some operations (currently ImageBlur, ImageBlurIntegral, ImageLocateSubImage,
+/// ImageLocateAll, their Approx variants and ImageHistogram) split their
+/// work among threads.
+/// By default, the library is single-threaded.
+
+//HIDE
+// Number of threads for parallel operations.
+static int nthreads = 1;
+//SHOW
+
+/// Set the number of threads used by parallel operations.
+/// n <= 0 selects one thread per online processor.
+void ImageSetThreads(int n) { ///
   //HIDE
+  if (n <= 0) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    n = ncpu > 0 ? (int)ncpu : 1;
+  }
+  nthreads = n;
+  //SHOW
+}
+
+/// Get the number of threads used by parallel operations.
+int ImageGetThreads(void) { ///
+  return nthreads;
+}
+
+//HIDE
+// Parallel execution.
+//
+// ParallelRun(fn, arg, nt) calls fn(arg, t) for t = 0, 1, ..., nt-1, each
+// on its own thread (t = 0 on the calling thread), and waits for all.
+// If a thread cannot be created, its call runs on the calling thread.
+typedef struct {
+  void (*fn)(void*, int);
+  void* arg;
+  int t;
+} Task;
+
+static void* TaskMain(void* p) {
+  Task* task = (Task*)p;
+  task->fn(task->arg, task->t);
+  return NULL;
+}
+
+static void ParallelRun(void (*fn)(void*, int), void* arg, int nt) {
+  pthread_t tid[nt];
+  Task task[nt];
+  int started[nt];
+  for (int t = 1; t < nt; t++) {
+    task[t] = (Task){ fn, arg, t };
+    started[t] = pthread_create(&tid[t], NULL, TaskMain, &task[t]) == 0;
+  }
+  fn(arg, 0);
+  for (int t = 1; t < nt; t++) {
+    if (started[t]) {
+      pthread_join(tid[t], NULL);
+    } else {
+      fn(arg, t);
+    }
+  }
+}
+
+// Start of band b, when splitting n items (rows, columns) in nb bands.
+static inline int Band(int n, int nb, int b) {
+  return (int)((long long)n*b/nb);
+}
+//SHOW
+
+
+/// Image management functions
+
+//HIDE
+// Pixel buffers.
+//
+// Rows of new images start on ROWALIGN-byte boundaries (a cache line, and
+// the widest vector), by padding the stride to a multiple of ROWALIGN,
+// unless that wastes more than 1/8 of the width (narrow images).  The
+// buffer itself is always ROWALIGN-aligned.
+// Buffers of HUGESIZE bytes or more are mapped directly from the kernel,
+// zero-filled on demand rather than by a memset, aligned to HUGESIZE,
+// and marked as candidates for transparent huge pages, to cut TLB misses.
+//
+// Buffer sizes are rounded up to size classes, so that freed buffers can
+// be kept in a pool and reused for images of the same (or similar)
+// dimensions, saving the page faults and zero-filling of a fresh buffer.
+// Operations that overwrite every pixel skip the zero-filling of reused
+// buffers too.
+#define ROWALIGN 64
+#define PAGESIZE ((size_t)4 << 10)
+#define HUGESIZE ((size_t)2 << 20)
+
+// Stride for rows of width pixels.
+static int PaddedStride(int width) {
+  int stride = (width + ROWALIGN-1) / ROWALIGN * ROWALIGN;
+  return (stride - width <= width/8) ? stride : width;
+}
+
+// Size class of a buffer of size bytes: the size actually allocated.
+static size_t SizeClass(size_t size) {
+  size_t unit = size < 16*PAGESIZE ? ROWALIGN : size < HUGESIZE ? PAGESIZE : HUGESIZE;
+  return (size + unit-1) / unit * unit;
+}
+
+// Allocate a new buffer of a size class, zero-filled if zero is nonzero.
+// Returns NULL on failure, with errno set.
+static uint8* BufferAlloc(size_t size, int zero) {
+  if (size < HUGESIZE) {
+    void* p = NULL;
+    errno = posix_memalign(&p, ROWALIGN, size + 1);
+    if (errno != 0) return NULL;
+    if (zero) memset(p, 0, size);
+    return (uint8*)p;
+  }
+  // Map extra HUGESIZE bytes, then trim to an aligned region.
+  uint8* p = (uint8*)mmap(NULL, size + HUGESIZE, PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  size_t head = (HUGESIZE - (uintptr_t)p % HUGESIZE) % HUGESIZE;
+  if (head > 0) munmap(p, head);
+  if (head < HUGESIZE) munmap(p + head + size, HUGESIZE - head);
+#ifdef MADV_HUGEPAGE
+  madvise(p + head, size, MADV_HUGEPAGE);  // only a hint: errors are harmless
+#endif
+  return p + head;
+}
+
+// Release a buffer of a size class.
+static void BufferFree(uint8* buf, size_t size) {
+  if (size < HUGESIZE) {
+    free(buf);
+  } else {
+    munmap(buf, size);
+  }
+}
+
+// The buffer pool: the most recently freed buffers, oldest first,
+// up to POOLMAX buffers and limit bytes.
+#define POOLMAX 32
+
+static struct {
+  pthread_mutex_t lock;
+  size_t limit;     // maximum bytes kept (0: no pool)
+  size_t total;     // bytes kept
+  int n;            // number of buffers kept
+  uint8* buf[POOLMAX];
+  size_t size[POOLMAX];
+} pool = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, {NULL}, {0} };
+
+// Remove buffer k from the pool and return it.  Call with the lock held.
+static uint8* PoolTake(int k) {
+  uint8* buf = pool.buf[k];
+  pool.total -= pool.size[k];
+  pool.n--;
+  memmove(&pool.buf[k], &pool.buf[k+1], (pool.n - k)*sizeof(pool.buf[0]));
+  memmove(&pool.size[k], &pool.size[k+1], (pool.n - k)*sizeof(pool.size[0]));
+  return buf;
+}
+
+// Free the oldest buffers until the pool has room for size more bytes
+// (and one more buffer).  Call with the lock held.
+static void PoolTrim(size_t size) {
+  while (pool.n > 0 && (pool.n == POOLMAX || pool.total + size > pool.limit)) {
+    size_t oldsize = pool.size[0];
+    BufferFree(PoolTake(0), oldsize);
+  }
+}
+
+// Get a buffer of a size class, from the pool if possible.
+// Returns NULL on failure, with errno set.
+static uint8* PixelAlloc(size_t size, int zero) {
+  uint8* buf = NULL;
+  pthread_mutex_lock(&pool.lock);
+  for (int k = pool.n-1; k >= 0; k--) {  // most recent first
+    if (pool.size[k] == size) {
+      buf = PoolTake(k);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool.lock);
+  if (buf == NULL) return BufferAlloc(size, zero);
+  if (zero) memset(buf, 0, size);
+  return buf;
+}
+
+// Return a buffer of a size class to the pool, or release it.
+static void PixelFree(uint8* buf, size_t size) {
+  pthread_mutex_lock(&pool.lock);
+  int keep = size <= pool.limit;
+  if (keep) {
+    PoolTrim(size);
+    pool.buf[pool.n] = buf;
+    pool.size[pool.n] = size;
+    pool.n++;
+    pool.total += size;
+  }
+  pthread_mutex_unlock(&pool.lock);
+  if (!keep) BufferFree(buf, size);
+}
+
+// Free a search pyramid (see ImageLocateSubImagePyramid).
+static void PyramidFree(struct pyramid* pyr);
+
+// Create a new image, with pixels zero-filled only if zero is nonzero.
+// (For operations that write every pixel.)
+// Same as ImageCreate otherwise.
+static Image ImageAlloc(int width, int height, uint8 maxval, int zero) {
   Image img = NULL;
+  size_t size = SizeClass((size_t)PaddedStride(width)*height);
   int success =
   check( (img = (Image)calloc(1, sizeof(*img))) != NULL, "Alloc image failed" ) &&
-  check( (img->pixel = (uint8*)calloc(width*height, sizeof(uint8))) != NULL, "Alloc pixels failed" );
+  check( (img->pixel = PixelAlloc(size, zero)) != NULL, "Alloc pixels failed" );
 
   if (success) {
     img->width = width;
     img->height = height;
+    img->stride = PaddedStride(width);
     img->maxval = maxval;
+    img->bufsize = size;
   } else {
     errsave = errno;
     free(img);
@@ -195,6 +446,49 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
     errno = errsave;
   }
   return img;
+}
+//SHOW
+
+/// Set the maximum number of bytes kept in the buffer pool.
+/// When images are destroyed, their pixel buffers are kept in a pool, up to
+/// that limit, to be reused by new images of the same (or similar)
+/// dimensions.  The oldest buffers are released first.
+/// limit = 0 (the default) disables the pool and releases all buffers.
+/// The pool is shared by all threads.
+void ImagePoolSetLimit(size_t limit) { ///
+  //HIDE
+  pthread_mutex_lock(&pool.lock);
+  pool.limit = limit;
+  PoolTrim(0);
+  pthread_mutex_unlock(&pool.lock);
+  //SHOW
+}
+
+/// Get the maximum number of bytes kept in the buffer pool.
+size_t ImagePoolLimit(void) { ///
+  //HIDE
+  pthread_mutex_lock(&pool.lock);
+  size_t limit = pool.limit;
+  pthread_mutex_unlock(&pool.lock);
+  return limit;
+  //SHOW
+}
+
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  // Insert your code here!
+  //HIDE
+  return ImageAlloc(width, height, maxval, 1);
   //SHOW
 }
 
@@ -208,12 +502,51 @@ void ImageDestroy(Image* imgp) { ///
   // Insert your code here!
   //HIDE
   Image img = *imgp;
-  if (img != NULL) { free(img->pixel); }
+  if (img != NULL) {
+    if (img->map != NULL) {
+      munmap(img->map, img->mapsize);
+    } else if (!img->view) {
+      PixelFree(img->pixel, img->bufsize);
+    }
+    free(img->hist);
+    PyramidFree(img->pyr);
+  }
   free(img);
   *imgp = NULL;
   //SHOW
 }
 
+/// Create a view of a rectangle of img.
+/// The view is an image that shares the pixels of the rectangle with img:
+/// any change to one is seen in the other.  Views work with all
+/// operations, and may be used to restrict in-place operations (such as
+/// ImageNegative or ImageBlur) to a region of img.
+/// Views of views are allowed.
+/// Requires: the rectangle (x, y, w, h) must be inside img.
+/// img must not be destroyed before the view.
+/// 
+/// On success, a new view is returned.
+/// (The caller is responsible for destroying the returned view, which
+/// does not affect img!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateView(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  //HIDE
+  Image view = NULL;
+  if (!check( (view = (Image)calloc(1, sizeof(*view))) != NULL, "Alloc image failed" )) {
+    return NULL;
+  }
+  view->width = w;
+  view->height = h;
+  view->maxval = img->maxval;
+  view->pixel = PixelPtr(img, x, y);
+  view->stride = img->stride;
+  view->view = 1;
+  view->owner = img->owner != NULL ? img->owner : img;
+  return view;
+  //SHOW
+}
 
 /// PGM file operations
 
@@ -232,6 +565,40 @@ static int skipComments(FILE* f) {
   return i;
 }
 
+// Parse a PGM header from file f, leaving f at the start of the raster.
+// Returns nonzero on success.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int readHeader(FILE* f, int* w, int* h, int* maxval) {
+  char c;
+  return
+  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", w) == 1 && *w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", h) == 1 && *h >= 0 , "Invalid height" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", maxval) == 1 && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+}
+
+// Read the raster of img from file f.
+// Returns nonzero on success.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int readPixels(FILE* f, Image img) {
+  int w = img->width;
+  int h = img->height;
+  if (Contiguous(img)) {
+    size_t n = (size_t)w*h;
+    return check( fread(img->pixel, sizeof(uint8), n, f) == n , "Reading pixels" );
+  }
+  for (int y = 0; y < h; y++) {  // padded rows
+    if (!check( fread(PixelPtr(img, 0, y), sizeof(uint8), w, f) == (size_t)w , "Reading pixels" )) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
@@ -240,26 +607,18 @@ static int skipComments(FILE* f) {
 Image ImageLoad(const char* filename) { ///
   int w, h;
   int maxval;
-  char c;
   FILE* f = NULL;
   Image img = NULL;
 
   int success = 
   check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
   // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  readHeader(f, &w, &h, &maxval) &&
   // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  (img = ImageAlloc(w, h, (uint8)maxval, 0)) != NULL &&  // no need to clear
   // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  readPixels(f, img);
+  PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
 
   // Cleanup
   if (!success) {
@@ -271,6 +630,119 @@ Image ImageLoad(const char* filename) { ///
   return img;
 }
 
+//HIDE
+// Parsing a PGM header in memory.
+// These follow the same rules as the fscanf calls in ImageLoad.
+
+// A cursor over a memory buffer.
+typedef struct {
+  const uint8* p;
+  const uint8* end;
+} Cursor;
+
+// Skip whitespace.
+static void cursorSpace(Cursor* c) {
+  while (c->p < c->end && isspace(*c->p)) c->p++;
+}
+
+// Match and skip 0 or more comment lines (see skipComments).
+static void cursorComments(Cursor* c) {
+  while (c->p + 1 < c->end && c->p[0] == '#' && c->p[1] != '\n') {
+    const uint8* nl = memchr(c->p, '\n', c->end - c->p);
+    if (nl == NULL) return;
+    c->p = nl + 1;
+  }
+}
+
+// Read an int (like "%d").  Returns 1 on success, 0 otherwise.
+static int cursorInt(Cursor* c, int* v) {
+  cursorSpace(c);
+  const uint8* q = c->p;
+  int neg = 0;
+  if (q < c->end && (*q == '+' || *q == '-')) { neg = *q == '-'; q++; }
+  if (q == c->end || !isdigit(*q)) return 0;
+  long long r = 0;
+  for (; q < c->end && isdigit(*q); q++) {
+    r = 10*r + (*q - '0');
+    if (r > (long long)1 << 31) return 0;  // would overflow
+  }
+  r = neg ? -r : r;
+  if (r > 0x7fffffff) return 0;
+  *v = (int)r;
+  c->p = q;
+  return 1;
+}
+//SHOW
+
+/// Load a raw PGM file by mapping it into memory.
+/// Same as ImageLoad, but the pixels are not copied: the image uses the
+/// raster in a private (copy-on-write) mapping of the file.
+/// Pixels are paged in from the file as they are accessed; changes to the
+/// image affect only the image, never the file.
+/// ImageDestroy releases the mapping.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) { ///
+  //HIDE
+  int w, h;
+  int maxval;
+  int fd = -1;
+  struct stat st;
+  void* map = MAP_FAILED;
+  size_t size = 0;
+  Cursor c;
+  Image img = NULL;
+
+  int success =
+  check( (fd = open(filename, O_RDONLY)) >= 0, "Open failed" ) &&
+  check( fstat(fd, &st) == 0, "Stat failed" ) &&
+  check( (size = (size_t)st.st_size) > 0, "Invalid file format" ) &&
+  check( (map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0)) != MAP_FAILED, "Mapping failed" );
+  if (success) {
+    c = (Cursor){ (const uint8*)map, (const uint8*)map + size };
+    // Parse PGM header
+    success =
+    check( size >= 2 && c.p[0] == 'P' && c.p[1] == '5' , "Invalid file format" ) &&
+    (c.p += 2, cursorSpace(&c), cursorComments(&c), 1) &&
+    check( cursorInt(&c, &w) && w >= 0 , "Invalid width" ) &&
+    (cursorSpace(&c), cursorComments(&c), 1) &&
+    check( cursorInt(&c, &h) && h >= 0 , "Invalid height" ) &&
+    (cursorSpace(&c), cursorComments(&c), 1) &&
+    check( cursorInt(&c, &maxval) && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
+    check( c.p < c.end && isspace(*c.p++) , "Whitespace expected" ) &&
+    check( (size_t)(c.end - c.p) >= (size_t)w*h , "Reading pixels" ) &&
+    check( (img = (Image)calloc(1, sizeof(*img))) != NULL, "Alloc image failed" );
+  }
+  if (success) {
+    img->width = w;
+    img->height = h;
+    img->stride = w;
+    img->maxval = maxval;
+    img->pixel = (uint8*)c.p;
+    img->map = map;
+    img->mapsize = size;
+    // Start reading the raster ahead, mostly in sequence.
+    // (These are only hints: errors are harmless.)
+    madvise(map, size, MADV_WILLNEED);
+    madvise(map, size, MADV_SEQUENTIAL);
+  }
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    if (map != MAP_FAILED) munmap(map, size);
+    errno = errsave;
+  }
+  if (fd >= 0) {
+    errsave = errno;
+    close(fd);  // the mapping remains valid
+    errno = errsave;
+  }
+  return img;
+  //SHOW
+}
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -284,9 +756,17 @@ int ImageSave(Image img, const char* filename) { ///
 
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" );
+  if (Contiguous(img)) {
+    size_t n = (size_t)w*h;
+    success = success &&
+    check( fwrite(img->pixel, sizeof(uint8), n, f) == n, "Writing pixels failed" ); 
+  } else {  // padded rows or a view: write row by row
+    for (int y = 0; success && y < h; y++) {
+      success = check( fwrite(PixelPtr(img, 0, y), sizeof(uint8), w, f) == (size_t)w, "Writing pixels failed" );
+    }
+  }
+  PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
 
   // Cleanup
   if (f != NULL) fclose(f);
@@ -325,13 +805,129 @@ void ImageStats(Image img, uint8* min, uint8* max) { ///
   assert (img != NULL);
   // Insert your code here!
   //HIDE
-  *min = PixMax;  // maxval would mask overflows!
-  *max = 0;
-  uint8 p;
-  for (int k = 0; k < img->width*img->height; k++) {
-    p = img->pixel[k];
-    if (p < *min) *min = p;
-    if (p > *max) *max = p;
+  ImageHist hist;
+  ImageHistogram(img, &hist);
+  *min = hist.min;
+  *max = hist.max;
+  //SHOW
+}
+
+//HIDE
+// Histogram.
+//
+// Each band of rows (one per thread) is counted into its own histogram.
+// Within a band, consecutive pixels are counted into 4 interleaved 32-bit
+// sub-histograms, so that increments of equal levels do not wait for each
+// other, and pixels are loaded 8 at a time.  The sub-histograms are added
+// into the 64-bit histogram of the band before they may overflow.
+typedef struct {
+  Image img;
+  int nb;                  // number of bands
+  uint64_t (*count)[256];  // histogram of each band
+} HistJob;
+
+static void HistBand(void* arg, int b) {
+  HistJob* job = (HistJob*)arg;
+  Image img = job->img;
+  int w = img->width;
+  int y0 = Band(img->height, job->nb, b);
+  int y1 = Band(img->height, job->nb, b+1);
+  uint64_t* count = job->count[b];
+  uint32_t sub[4][256];
+  memset(sub, 0, sizeof(sub));
+  memset(count, 0, 256 * sizeof(*count));
+  // Each sub-histogram bin grows by at most w/4 per row.
+  int rows = (1 << 30) / (w > 0 ? w : 1);
+  if (rows < 1) rows = 1;
+  for (int y = y0; y < y1; y++) {
+    const uint8* p = PixelPtr(img, 0, y);
+    int x = 0;
+    for (; x + 8 <= w; x += 8) {
+      uint64_t v;
+      memcpy(&v, p + x, 8);
+      sub[0][v & 0xff]++;
+      sub[1][(v >> 8) & 0xff]++;
+      sub[2][(v >> 16) & 0xff]++;
+      sub[3][(v >> 24) & 0xff]++;
+      sub[0][(v >> 32) & 0xff]++;
+      sub[1][(v >> 40) & 0xff]++;
+      sub[2][(v >> 48) & 0xff]++;
+      sub[3][v >> 56]++;
+    }
+    for (; x < w; x++) sub[0][p[x]]++;
+    if ((y - y0 + 1) % rows == 0 || y == y1-1) {
+      for (int i = 0; i < 256; i++) {
+        count[i] += (uint64_t)sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+      }
+      memset(sub, 0, sizeof(sub));
+    }
+  }
+}
+
+// Compute the histogram and statistics of img into *hist.
+static void HistCompute(Image img, ImageHist* hist) {
+  int w = img->width;
+  int h = img->height;
+  // One band per thread, of at least 64K pixels (and a few rows).
+  int nb = nthreads;
+  if (nb > h/8) nb = h/8;
+  if ((long long)nb * 65536 > (long long)w*h) nb = (int)((long long)w*h / 65536);
+  if (nb < 1) nb = 1;
+  uint64_t count[nb][256];
+  HistJob job = { img, nb, count };
+  if (nb == 1) {
+    HistBand(&job, 0);
+  } else {
+    ParallelRun(HistBand, &job, nb);
+  }
+  uint64_t sum = 0, sum2 = 0;
+  hist->pixels = 0;
+  hist->min = PixMax;  // maxval would mask overflows!
+  hist->max = 0;
+  for (int i = 0; i < 256; i++) {
+    uint64_t c = 0;
+    for (int b = 0; b < nb; b++) c += count[b][i];
+    hist->count[i] = c;
+    if (c == 0) continue;
+    if (hist->pixels == 0) hist->min = (uint8)i;
+    hist->max = (uint8)i;
+    hist->pixels += c;
+    sum += c * i;
+    sum2 += c * i * i;
+  }
+  hist->mean = 0.0;
+  hist->variance = 0.0;
+  if (hist->pixels > 0) {
+    hist->mean = (double)sum / (double)hist->pixels;
+    hist->variance = (double)sum2 / (double)hist->pixels - hist->mean * hist->mean;
+    if (hist->variance < 0.0) hist->variance = 0.0;  // rounding
+  }
+  PIXMEM += (unsigned long)w*h;  // one read per pixel
+}
+//SHOW
+
+/// Compute the histogram and statistics of the gray levels of img
+/// into *hist, in a single pass.
+/// The result is cached in img (unless it is a view), and reused until
+/// img is modified.
+void ImageHistogram(Image img, ImageHist* hist) { ///
+  assert (img != NULL);
+  assert (hist != NULL);
+  //HIDE
+  if (img->histValid) {
+    *hist = *img->hist;
+    return;
+  }
+  HistCompute(img, hist);
+  if (img->view) return;   // views do not cache
+  if (img->hist == NULL) {
+    errsave = errno;  // failing to cache is not an error
+    img->hist = (ImageHist*)malloc(sizeof(*img->hist));
+    errno = errsave;
+  }
+  if (img->hist != NULL) {
+    *img->hist = *hist;
+    img->histValid = 1;
   }
   //SHOW
 }
@@ -360,16 +956,16 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index;
+// The returned index must satisfy (0 <= index < img->stride*img->height)
+static inline size_t G(Image img, int x, int y) {
+  size_t index;
   // Insert your code here!
   //HIDE
   //x = mod(x, img->width);
   //y = mod(y, img->height);
-  index = x + img->width*y;
+  index = (size_t)x + (size_t)img->stride*y;
   //SHOW
-  assert (0 <= index && index < img->width*img->height);
+  assert (index < (size_t)img->stride*img->height);
   return index;
 }
 
@@ -386,9 +982,31 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (store)
+  Modified(img);
   img->pixel[G(img, x, y)] = level;
 } 
 
+/// Get the address of the ImageWidth(img) pixels of row y, which are
+/// contiguous, for reading only (use ImageSetRow to change them).
+/// The address is valid until img is destroyed.
+/// Requires: 0 <= y < ImageHeight(img).
+const uint8* ImageRow(Image img, int y) { ///
+  assert (img != NULL);
+  assert (0 <= y && y < img->height);
+  return PixelPtr(img, 0, y);
+}
+
+/// Set the ImageWidth(img) pixels of row y to the levels at row.
+/// Requires: 0 <= y < ImageHeight(img), levels <= ImageMaxval(img).
+void ImageSetRow(Image img, int y, const uint8* row) { ///
+  assert (img != NULL);
+  assert (0 <= y && y < img->height);
+  assert (row != NULL);
+  PIXMEM += (unsigned long)img->width;  // count pixel stores
+  Modified(img);
+  memcpy(PixelPtr(img, 0, y), row, (size_t)img->width);
+}
+
 
 /// Pixel transformations
 
@@ -398,6 +1016,9 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 /// They never fail.
 
 //HIDE
+static inline int max(int a, int b) { return a >= b ? a : b; }
+static inline int min(int a, int b) { return a <= b ? a : b; }
+
 // These are internal functions to create and manipulate pixel maps.
 // A pixel map is a uint[256] array that defines a pixel to pixel mapping,
 // that may then be applied to an image.
@@ -440,13 +1061,206 @@ static void PixMapAffine(uint8* map, double m, double b, uint8 maxval) {
   }
 }
 
+// Pixel map kernels.
+//
+// Applying a map is a table lookup per pixel, which the compiler cannot
+// vectorize.  But the maps built by ImageNegative, ImageThreshold and
+// ImageBrighten have simple closed forms that SSE2 computes 16 pixels at
+// a time, so ImageMap first classifies the map.  The classification is
+// exact: a closed form is only used if it reproduces all 256 entries.
+// Other maps go through a table kernel: with AVX2, vpshufb looks up
+// 16-entry slices of the map for 32 pixels at a time; else, a scalar loop.
+
+// Shapes of pixel maps:
+//   MAP_IDENTITY:  map[p] = p
+//   MAP_NEGATIVE:  map[p] = max(a - p, 0)
+//   MAP_THRESHOLD: map[p] = (p < a ? 0 : b)
+//   MAP_SCALE:     map[p] = min((min(p, c)*a + 2^(s-1)) >> s, b)
+//   MAP_TABLE:     anything else
+enum { MAP_IDENTITY, MAP_NEGATIVE, MAP_THRESHOLD, MAP_SCALE, MAP_TABLE };
+
+typedef struct {
+  int kind;
+  int a, b, c, s;  // parameters, as above
+} MapShape;
+
+// Integer division rounding up (for any sign of n, d > 0).
+static inline int divup(int n, int d) {
+  return n >= 0 ? (n + d - 1) / d : -(-n / d);
+}
+
+// Find the MAP_SCALE parameters that reproduce map, if any.
+// The map must be 0 at 0, nondecreasing and saturate at b from c onwards.
+// For each shift s, the entries below c bound a by an interval
+// (derived from m*2^s <= p*a + 2^(s-1) < (m+1)*2^s), and c bounds it below.
+// Shifts are limited so that the kernel fits in signed 16-bit products.
+static int PixMapFitScale(const uint8* map, MapShape* ms) {
+  if (map[0] != 0) return 0;
+  int b = map[PixMax];
+  int c = 0;
+  while (map[c] != b) c++;
+  if (c == 0) return 0;  // constant map
+  for (int p = 1; p <= PixMax; p++) {
+    if (map[p] < map[p-1]) return 0;
+  }
+  for (int s = 14; s >= 0; s--) {
+    int h = (1 << s) >> 1;
+    int lo = divup((b << s) - h, c);  // saturate at c
+    int hi = 32767;
+    for (int p = 1; p < c && lo <= hi; p++) {
+      lo = max(lo, divup((map[p] << s) - h, p));
+      hi = min(hi, divup(((map[p]+1) << s) - h, p) - 1);
+    }
+    if (lo <= hi) {
+      ms->kind = MAP_SCALE;
+      ms->a = max(lo, 0); ms->b = b; ms->c = c; ms->s = s;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Value of pixel level p under shape ms (except MAP_TABLE).
+static int MapShapeValue(const MapShape* ms, int p) {
+  switch (ms->kind) {
+  case MAP_IDENTITY: return p;
+  case MAP_NEGATIVE: return max(ms->a - p, 0);
+  case MAP_THRESHOLD: return p < ms->a ? 0 : ms->b;
+  case MAP_SCALE:
+    return min((min(p, ms->c)*ms->a + ((1 << ms->s) >> 1)) >> ms->s, ms->b);
+  }
+  return -1;
+}
+
+// Classify a pixel map.
+static MapShape PixMapClassify(const uint8* map) {
+  MapShape ms = { MAP_TABLE, 0, 0, 0, 0 };
+  int t = 1;
+  while (t <= PixMax && map[t] == map[0]) t++;
+  if (t > PixMax) {  // constant map
+    ms.kind = MAP_THRESHOLD; ms.a = 0; ms.b = map[0];
+  } else if (map[0] == 0 && map[t] > 0) {  // candidate step at t
+    ms.kind = MAP_THRESHOLD; ms.a = t; ms.b = map[t];
+  }
+  MapShape cand[4] = {
+    { MAP_IDENTITY, 0, 0, 0, 0 },
+    { MAP_NEGATIVE, map[0], 0, 0, 0 },
+    ms,
+    { MAP_TABLE, 0, 0, 0, 0 },
+  };
+  PixMapFitScale(map, &cand[3]);
+  for (int i = 0; i < 4; i++) {
+    if (cand[i].kind == MAP_TABLE) continue;
+    int p = 0;
+    while (p <= PixMax && MapShapeValue(&cand[i], p) == map[p]) p++;
+    if (p > PixMax) return cand[i];
+  }
+  ms.kind = MAP_TABLE;
+  return ms;
+}
+
+#ifdef __SSE2__
+// Apply shape ms (not MAP_IDENTITY or MAP_TABLE) to 16 pixels.
+static inline __m128i MapShape16(const MapShape* ms, __m128i v) {
+  switch (ms->kind) {
+  case MAP_NEGATIVE:
+    return _mm_subs_epu8(_mm_set1_epi8((char)ms->a), v);
+  case MAP_THRESHOLD: {
+    // v >= a  <=>  max(v, a) == v
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8((char)ms->a)), v);
+    return _mm_and_si128(ge, _mm_set1_epi8((char)ms->b));
+  }
+  default: {  // MAP_SCALE
+    // Pair each level p with 1, so that madd computes p*a + 2^(s-1).
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i coef = _mm_set1_epi32((((1 << ms->s) >> 1) << 16) | ms->a);
+    const __m128i shift = _mm_cvtsi32_si128(ms->s);
+    v = _mm_min_epu8(v, _mm_set1_epi8((char)ms->c));
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    __m128i q0 = _mm_srl_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(lo, one), coef), shift);
+    __m128i q1 = _mm_srl_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(lo, one), coef), shift);
+    __m128i q2 = _mm_srl_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(hi, one), coef), shift);
+    __m128i q3 = _mm_srl_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(hi, one), coef), shift);
+    v = _mm_packus_epi16(_mm_packs_epi32(q0, q1), _mm_packs_epi32(q2, q3));
+    return _mm_min_epu8(v, _mm_set1_epi8((char)ms->b));
+  }
+  }
+}
+#endif
+
+#ifdef TARGET_AVX2
+// Check (once) if the CPU supports AVX2.
+static int CpuHasAVX2(void) {
+  static int avx2 = -1;
+  if (avx2 < 0) avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+}
+
+// Apply an arbitrary map to n pixels, 32 at a time, with AVX2.
+// The map is cut into 16 slices of 16 entries.  Level v is looked up in
+// slice h by vpshufb with index (v - 16h) +sat 0x70: that has bit 7 clear,
+// and low nibble v&15, only for v in [16h, 16h+15]; vpshufb yields 0 for
+// the other levels, so the 16 partial lookups can simply be OR-ed.
+// Returns the number of pixels processed.
+__attribute__((target("avx2")))
+static size_t MapTableAVX2(uint8* pix, size_t n, const uint8* map) {
+  __m256i slice[16];
+  for (int h = 0; h < 16; h++) {
+    slice[h] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(map + 16*h)));
+  }
+  const __m256i bias = _mm256_set1_epi8(0x70);
+  const __m256i step = _mm256_set1_epi8(0x10);
+  size_t k = 0;
+  for (; k + 32 <= n; k += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(pix + k));
+    __m256i r = _mm256_setzero_si256();
+    for (int h = 0; h < 16; h++) {
+      r = _mm256_or_si256(r, _mm256_shuffle_epi8(slice[h], _mm256_adds_epu8(v, bias)));
+      v = _mm256_sub_epi8(v, step);
+    }
+    _mm256_storeu_si256((__m256i*)(pix + k), r);
+  }
+  return k;
+}
+#endif
+
+// In-place apply map with shape ms to n consecutive pixels.
+static void MapPixels(uint8* pix, size_t n, const uint8* map, const MapShape* ms) {
+  size_t k = 0;
+  if (ms->kind == MAP_IDENTITY) return;
+  if (ms->kind == MAP_TABLE) {
+#ifdef TARGET_AVX2
+    if (CpuHasAVX2()) k = MapTableAVX2(pix, n, map);
+#endif
+  } else {
+#ifdef __SSE2__
+    for (; k + 16 <= n; k += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(pix + k));
+      _mm_storeu_si128((__m128i*)(pix + k), MapShape16(ms, v));
+    }
+#endif
+  }
+  for (; k < n; k++) {
+    pix[k] = map[pix[k]];
+  }
+}
+
 // In-place apply mapping to image pixels.
-static void ImageMap(Image img, uint8* map) {
+static void ImageMap(Image img, const uint8* map) {
   assert (img != NULL);
-  for (int k = 0; k < img->width*img->height; k++) {
-    PIXMEM += 2;
-    img->pixel[k] = map[img->pixel[k]];
+  Modified(img);
+  size_t n = (size_t)img->width*img->height;
+  MapShape ms = PixMapClassify(map);
+  if (Contiguous(img)) {
+    MapPixels(img->pixel, n, map, &ms);
+  } else {  // a view: map row by row
+    for (int y = 0; y < img->height; y++) {
+      MapPixels(PixelPtr(img, 0, y), img->width, map, &ms);
+    }
   }
+  PIXMEM += 2*(unsigned long)n;  // one read and one write per pixel
 }
 //SHOW
 
@@ -495,22 +1309,182 @@ void ImageBrighten(Image img, double factor) { ///
 }
 
 
-/// Geometric transformations
+/// Pixel maps
 
-/// These functions apply geometric transformations to an image,
-/// returning a new image as a result.
-/// 
-/// Success and failure are treated as in ImageCreate:
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
+/// A pixel map is an array of 1+PixMax levels that maps each gray level p
+/// to a new level map[p].  ImageNegative, ImageThreshold and ImageBrighten
+/// are all pixel maps, so a chain of them can be composed into one map
+/// and applied in a single pass over the image, with the same result.
+/// The ImageMap* functions below compose the map of an operation, as it
+/// would be applied to img, after the given map: map[p] = op(map[p]).
 
-// Implementation hint: 
-// Call ImageCreate whenever you need a new image!
+/// Init map with the identity map.
+void ImageMapIdentity(uint8* map) { ///
+  assert (map != NULL);
+  //HIDE
+  PixMapInit(map);
+  //SHOW
+}
 
-/// Rotate an image.
-/// Returns a rotated version of the image.
-/// The rotation is 90 degrees clockwise.
+/// Compose ImageNegative(img) after map.
+void ImageMapNegative(Image img, uint8* map) { ///
+  assert (img != NULL);
+  assert (map != NULL);
+  //HIDE
+  PixMapNegative(map, img->maxval);
+  //SHOW
+}
+
+/// Compose ImageThreshold(img, thr) after map.
+void ImageMapThreshold(Image img, uint8* map, uint8 thr) { ///
+  assert (img != NULL);
+  assert (map != NULL);
+  //HIDE
+  PixMapThreshold(map, thr, img->maxval);
+  //SHOW
+}
+
+/// Compose ImageBrighten(img, factor) after map.
+void ImageMapBrighten(Image img, uint8* map, double factor) { ///
+  assert (img != NULL);
+  assert (map != NULL);
+  //HIDE
+  PixMapAffine(map, factor, 0.0, img->maxval);
+  //SHOW
+}
+
+/// Apply pixel map to img.
+/// Each pixel level p is replaced by map[p].
+/// The image is changed in-place.
+void ImageApplyMap(Image img, const uint8* map) { ///
+  assert (img != NULL);
+  assert (map != NULL);
+  //HIDE
+  ImageMap(img, map);
+  //SHOW
+}
+
+
+/// Geometric transformations
+
+/// These functions apply geometric transformations to an image,
+/// returning a new image as a result.
+/// 
+/// Success and failure are treated as in ImageCreate:
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+
+// Implementation hint: 
+// Call ImageCreate whenever you need a new image!
+
+//HIDE
+// Kernels for geometric transformations.
+//
+// All rotations and flips are built on two raw kernels: a cache-blocked
+// transpose and a row reversal.  Both take signed row strides, so reading
+// the source bottom-up, or writing the destination bottom-up, yields the
+// other orientations at no extra cost:
+//   ImageRotate    = transpose into destination rows in reverse order;
+//   ImageRotate270 = transpose from source rows in reverse order;
+//   ImageRotate180 = row reversal from source rows in reverse order;
+//   ImageMirror    = row reversal;
+//   ImageFlipUD    = row copy from source rows in reverse order.
+
+// Side of the square tiles walked by TransposeRect.
+// A 64x64 source tile plus its destination tile (8 KiB) stays in L1,
+// and the 64 destination rows it touches stay in the TLB.
+#define TILE 64
+
+#ifdef __SSE2__
+// Transpose an 8x8 block of bytes in registers.
+// Reads 8 rows of 8 bytes from src and writes them as columns to dst.
+static inline void Transpose8x8(const uint8* src, ptrdiff_t sstride,
+                                uint8* dst, ptrdiff_t dstride) {
+  __m128i r0 = _mm_loadl_epi64((const __m128i*)(src + 0*sstride));
+  __m128i r1 = _mm_loadl_epi64((const __m128i*)(src + 1*sstride));
+  __m128i r2 = _mm_loadl_epi64((const __m128i*)(src + 2*sstride));
+  __m128i r3 = _mm_loadl_epi64((const __m128i*)(src + 3*sstride));
+  __m128i r4 = _mm_loadl_epi64((const __m128i*)(src + 4*sstride));
+  __m128i r5 = _mm_loadl_epi64((const __m128i*)(src + 5*sstride));
+  __m128i r6 = _mm_loadl_epi64((const __m128i*)(src + 6*sstride));
+  __m128i r7 = _mm_loadl_epi64((const __m128i*)(src + 7*sstride));
+  // Rows a..h, columns 0..7:
+  __m128i t0 = _mm_unpacklo_epi8(r0, r1);   // a0 b0 a1 b1 ... a7 b7
+  __m128i t1 = _mm_unpacklo_epi8(r2, r3);   // c0 d0 c1 d1 ... c7 d7
+  __m128i t2 = _mm_unpacklo_epi8(r4, r5);   // e0 f0 e1 f1 ... e7 f7
+  __m128i t3 = _mm_unpacklo_epi8(r6, r7);   // g0 h0 g1 h1 ... g7 h7
+  __m128i u0 = _mm_unpacklo_epi16(t0, t1);  // a0 b0 c0 d0 ... a3 b3 c3 d3
+  __m128i u1 = _mm_unpackhi_epi16(t0, t1);  // a4 b4 c4 d4 ... a7 b7 c7 d7
+  __m128i u2 = _mm_unpacklo_epi16(t2, t3);  // e0 f0 g0 h0 ... e3 f3 g3 h3
+  __m128i u3 = _mm_unpackhi_epi16(t2, t3);  // e4 f4 g4 h4 ... e7 f7 g7 h7
+  __m128i v0 = _mm_unpacklo_epi32(u0, u2);  // columns 0 and 1
+  __m128i v1 = _mm_unpackhi_epi32(u0, u2);  // columns 2 and 3
+  __m128i v2 = _mm_unpacklo_epi32(u1, u3);  // columns 4 and 5
+  __m128i v3 = _mm_unpackhi_epi32(u1, u3);  // columns 6 and 7
+  _mm_storel_epi64((__m128i*)(dst + 0*dstride), v0);
+  _mm_storel_epi64((__m128i*)(dst + 1*dstride), _mm_unpackhi_epi64(v0, v0));
+  _mm_storel_epi64((__m128i*)(dst + 2*dstride), v1);
+  _mm_storel_epi64((__m128i*)(dst + 3*dstride), _mm_unpackhi_epi64(v1, v1));
+  _mm_storel_epi64((__m128i*)(dst + 4*dstride), v2);
+  _mm_storel_epi64((__m128i*)(dst + 5*dstride), _mm_unpackhi_epi64(v2, v2));
+  _mm_storel_epi64((__m128i*)(dst + 6*dstride), v3);
+  _mm_storel_epi64((__m128i*)(dst + 7*dstride), _mm_unpackhi_epi64(v3, v3));
+}
+
+// Reverse the order of the 16 bytes in v.
+static inline __m128i Reverse16(__m128i v) {
+  v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));    // reverse dwords
+  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));  // swap words...
+  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));  // ...in each dword
+  return _mm_or_si128(_mm_srli_epi16(v, 8), _mm_slli_epi16(v, 8));  // swap bytes
+}
+#endif
+
+// Transpose a w x h block of bytes:
+//   dst[x*dstride + y] = src[y*sstride + x], for 0<=x<w, 0<=y<h.
+// Strides may be negative.
+static void TransposeRect(const uint8* src, ptrdiff_t sstride,
+                          uint8* dst, ptrdiff_t dstride, int w, int h) {
+  for (int y0 = 0; y0 < h; y0 += TILE) {
+    int y1 = min(y0 + TILE, h);
+    for (int x0 = 0; x0 < w; x0 += TILE) {
+      int x1 = min(x0 + TILE, w);
+      int y = y0;
+#ifdef __SSE2__
+      for (; y + 8 <= y1; y += 8) {
+        int x = x0;
+        for (; x + 8 <= x1; x += 8) {
+          Transpose8x8(src + y*sstride + x, sstride, dst + x*dstride + y, dstride);
+        }
+        for (; x < x1; x++) {  // leftover columns of the tile
+          for (int j = y; j < y+8; j++) dst[x*dstride + j] = src[j*sstride + x];
+        }
+      }
+#endif
+      for (; y < y1; y++) {  // leftover rows of the tile
+        for (int x = x0; x < x1; x++) dst[x*dstride + y] = src[y*sstride + x];
+      }
+    }
+  }
+}
+
+// Copy n bytes from src to dst in reverse order: dst[i] = src[n-1-i].
+static void ReverseRow(const uint8* src, uint8* dst, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + n-16-i));
+    _mm_storeu_si128((__m128i*)(dst + i), Reverse16(v));
+  }
+#endif
+  for (; i < n; i++) dst[i] = src[n-1-i];
+}
+//SHOW
+
+/// Rotate an image.
+/// Returns a rotated version of the image.
+/// The rotation is 90 degrees clockwise.
 /// Ensures: The original img is not modified.
 /// 
 /// On success, a new image is returned.
@@ -522,17 +1496,56 @@ Image ImageRotate(Image img) { ///
   //HIDE
   int w = img->height;
   int h = img->width;
-  Image img2 = ImageCreate(w, h, img->maxval);
+  Image img2 = ImageAlloc(w, h, img->maxval, 0);
   if (img2 == NULL) return NULL;
-  int i, j;
-  for (i = 0; i < w; i++) {
-    for (j = 0; j < h; j++) {
-      // apply transform:
-      // x = r[0][0]*i + r[0][1]*j + t[0];
-      // y = r[1][0]*i + r[1][1]*j + t[1];
-      ImageSetPixel(img2, i, j, ImageGetPixel(img, h-1-j, i));
-    }
+  // img2(i, j) = img(h-1-j, i): transpose, writing img2 rows bottom-up.
+  TransposeRect(img->pixel, img->stride, PixelPtr(img2, 0, h-1), -(ptrdiff_t)img2->stride, h, w);
+  PIXMEM += 2*(unsigned long)w*h;  // one read and one write per pixel
+  return img2;
+  //SHOW
+}
+
+/// Rotate an image by 180 degrees.
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) { ///
+  assert (img != NULL);
+  //HIDE
+  int w = img->width;
+  int h = img->height;
+  Image img2 = ImageAlloc(w, h, img->maxval, 0);
+  if (img2 == NULL) return NULL;
+  // img2(i, j) = img(w-1-i, h-1-j): reverse rows, taken bottom-up.
+  for (int j = 0; j < h; j++) {
+    ReverseRow(PixelPtr(img, 0, h-1-j), PixelPtr(img2, 0, j), w);
   }
+  PIXMEM += 2*(unsigned long)w*h;  // one read and one write per pixel
+  return img2;
+  //SHOW
+}
+
+/// Rotate an image by 270 degrees.
+/// Returns a rotated version of the image, the same as applying
+/// ImageRotate three times.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate270(Image img) { ///
+  assert (img != NULL);
+  //HIDE
+  int w = img->height;
+  int h = img->width;
+  Image img2 = ImageAlloc(w, h, img->maxval, 0);
+  if (img2 == NULL) return NULL;
+  // img2(i, j) = img(j, w-1-i): transpose, reading img rows bottom-up.
+  TransposeRect(PixelPtr(img, 0, w-1), -(ptrdiff_t)img->stride, img2->pixel, img2->stride, h, w);
+  PIXMEM += 2*(unsigned long)w*h;  // one read and one write per pixel
   return img2;
   //SHOW
 }
@@ -551,17 +1564,36 @@ Image ImageMirror(Image img) { ///
   // This could be done in-place too!
   int w = img->width;
   int h = img->height;
-  Image img2 = ImageCreate(w, h, img->maxval);
+  Image img2 = ImageAlloc(w, h, img->maxval, 0);
   if (img2 == NULL) return NULL;
-  int i, j;
-  for (i = 0; i < w; i++) {
-    for (j = 0; j < h; j++) {
-      // apply transform:
-      // x = r[0][0]*i + r[0][1]*j + t[0];
-      // y = r[1][0]*i + r[1][1]*j + t[1];
-      ImageSetPixel(img2, i, j, ImageGetPixel(img, w-1-i, j));
-    }
+  // img2(i, j) = img(w-1-i, j): reverse each row.
+  for (int j = 0; j < h; j++) {
+    ReverseRow(PixelPtr(img, 0, j), PixelPtr(img2, 0, j), w);
+  }
+  PIXMEM += 2*(unsigned long)w*h;  // one read and one write per pixel
+  return img2;
+  //SHOW
+}
+
+/// Flip an image upside-down.
+/// Returns a flipped version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageFlipUD(Image img) { ///
+  assert (img != NULL);
+  //HIDE
+  int w = img->width;
+  int h = img->height;
+  Image img2 = ImageAlloc(w, h, img->maxval, 0);
+  if (img2 == NULL) return NULL;
+  // img2(i, j) = img(i, h-1-j): copy rows bottom-up.
+  for (int j = 0; j < h; j++) {
+    memcpy(PixelPtr(img2, 0, j), PixelPtr(img, 0, h-1-j), w);
   }
+  PIXMEM += 2*(unsigned long)w*h;  // one read and one write per pixel
   return img2;
   //SHOW
 }
@@ -583,14 +1615,152 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
   assert (ImageValidRect(img, x, y, w, h));
   // Insert your code here!
   //HIDE
-  Image img2 = ImageCreate(w, h, img->maxval);
+  Image img2 = ImageAlloc(w, h, img->maxval, 0);
+  if (img2 == NULL) return NULL;
+  for (int j = 0; j < h; j++) {
+    memcpy(PixelPtr(img2, 0, j), PixelPtr(img, x, y+j), w);
+  }
+  PIXMEM += 2*(unsigned long)w*h;  // one read and one write per pixel
+  return img2;
+  //SHOW
+}
+
+
+/// Fused geometric transformations
+
+//HIDE
+// Compose t with a transformation g that takes pixel (i, j) of its result
+// from pixel (px + gi*i + gj*j, py + hi*i + hj*j) of the result of t,
+// and has size w x h.
+static void XformCompose(ImageXform* t, int px, int py,
+                         int gi, int gj, int hi, int hj, int w, int h) {
+  ImageXform r;
+  r.x0 = t->x0 + t->xi*px + t->xj*py;
+  r.y0 = t->y0 + t->yi*px + t->yj*py;
+  r.xi = t->xi*gi + t->xj*hi;
+  r.xj = t->xi*gj + t->xj*hj;
+  r.yi = t->yi*gi + t->yj*hi;
+  r.yj = t->yi*gj + t->yj*hj;
+  r.width = w;
+  r.height = h;
+  r.srcw = t->srcw;
+  r.srch = t->srch;
+  *t = r;
+}
+//SHOW
+
+/// Init t as the identity transformation of img.
+void ImageXformInit(ImageXform* t, Image img) { ///
+  assert (t != NULL);
+  assert (img != NULL);
+  //HIDE
+  t->x0 = t->y0 = 0;
+  t->xi = 1; t->xj = 0;
+  t->yi = 0; t->yj = 1;
+  t->width = t->srcw = img->width;
+  t->height = t->srch = img->height;
+  //SHOW
+}
+
+void ImageXformRotate(ImageXform* t) { ///
+  assert (t != NULL);
+  //HIDE
+  // result(i, j) = t(w-1-j, i), as in ImageRotate.
+  XformCompose(t, t->width-1, 0, 0, -1, 1, 0, t->height, t->width);
+  //SHOW
+}
+
+void ImageXformRotate180(ImageXform* t) { ///
+  assert (t != NULL);
+  //HIDE
+  // result(i, j) = t(w-1-i, h-1-j)
+  XformCompose(t, t->width-1, t->height-1, -1, 0, 0, -1, t->width, t->height);
+  //SHOW
+}
+
+void ImageXformRotate270(ImageXform* t) { ///
+  assert (t != NULL);
+  //HIDE
+  // result(i, j) = t(j, h-1-i)
+  XformCompose(t, 0, t->height-1, 0, 1, -1, 0, t->height, t->width);
+  //SHOW
+}
+
+void ImageXformMirror(ImageXform* t) { ///
+  assert (t != NULL);
+  //HIDE
+  // result(i, j) = t(w-1-i, j)
+  XformCompose(t, t->width-1, 0, -1, 0, 0, 1, t->width, t->height);
+  //SHOW
+}
+
+void ImageXformFlipUD(ImageXform* t) { ///
+  assert (t != NULL);
+  //HIDE
+  // result(i, j) = t(i, h-1-j)
+  XformCompose(t, 0, t->height-1, 1, 0, 0, -1, t->width, t->height);
+  //SHOW
+}
+
+/// Check if rectangular area (x,y,w,h) is inside the result of t.
+/// Same rules as ImageValidRect.
+int ImageXformValidRect(const ImageXform* t, int x, int y, int w, int h) { ///
+  assert (t != NULL);
+  //HIDE
+  return 0 <= x && x < t->width && 0 <= y && y < t->height &&
+         0 <= x+w-1 && x+w-1 < t->width && 0 <= y+h-1 && y+h-1 < t->height;
+  //SHOW
+}
+
+/// Compose t with ImageCrop.
+void ImageXformCrop(ImageXform* t, int x, int y, int w, int h) { ///
+  assert (t != NULL);
+  assert (ImageXformValidRect(t, x, y, w, h));
+  //HIDE
+  // result(i, j) = t(x+i, y+j)
+  XformCompose(t, x, y, 1, 0, 0, 1, w, h);
+  //SHOW
+}
+
+/// Apply transformation t to img.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageXformApply(Image img, const ImageXform* t) { ///
+  assert (img != NULL);
+  assert (t != NULL);
+  assert (t->srcw == img->width && t->srch == img->height);
+  //HIDE
+  int w = t->width;
+  int h = t->height;
+  Image img2 = ImageAlloc(w, h, img->maxval, 0);
   if (img2 == NULL) return NULL;
-  int i, j;
-  for (i = 0; i < w; i++) {
-    for (j = 0; j < h; j++) {
-      ImageSetPixel(img2, i, j, ImageGetPixel(img, x+i, y+j));
+  if (t->xj == 0) {
+    // Rows come from rows: result row j is source row y0 + yj*j,
+    // read forwards (xi = 1) or backwards (xi = -1).
+    for (int j = 0; j < h; j++) {
+      int y = t->y0 + t->yj*j;
+      if (t->xi > 0) {
+        memcpy(PixelPtr(img2, 0, j), PixelPtr(img, t->x0, y), w);
+      } else {
+        ReverseRow(PixelPtr(img, t->x0 - (w-1), y), PixelPtr(img2, 0, j), w);
+      }
+    }
+  } else {
+    // Rows come from columns: result(i, j) = img(x0 + xj*j, y0 + yi*i).
+    // The source is read with row stride yi*stride; for xj = -1, the
+    // result rows are written bottom-up, so that source columns go forwards.
+    const uint8* src = PixelPtr(img, t->xj > 0 ? t->x0 : t->x0 - (h-1), t->y0);
+    ptrdiff_t sstride = t->yi * (ptrdiff_t)img->stride;
+    if (t->xj > 0) {
+      TransposeRect(src, sstride, img2->pixel, img2->stride, h, w);
+    } else {
+      TransposeRect(src, sstride, PixelPtr(img2, 0, h-1), -(ptrdiff_t)img2->stride, h, w);
     }
   }
+  PIXMEM += 2*(unsigned long)w*h;  // one read and one write per pixel
   return img2;
   //SHOW
 }
@@ -610,15 +1780,109 @@ void ImagePaste(Image img1, int x, int y, Image img2) { ///
   //HIDE
   int w = img2->width;
   int h = img2->height;
-  int i, j;
-  for (i = 0; i < w; i++) {
-    for (j = 0; j < h; j++) {
-      ImageSetPixel(img1, x+i, y+j, ImageGetPixel(img2, i, j));
-    }
+  Modified(img1);
+  // img2 may be a view overlapping img1: if the destination is further
+  // down in memory, copy rows bottom-up.
+  int bottomup = (uintptr_t)PixelPtr(img1, x, y) > (uintptr_t)img2->pixel;
+  for (int j = 0; j < h; j++) {
+    int r = bottomup ? h-1-j : j;
+    memmove(PixelPtr(img1, x, y+r), PixelPtr(img2, 0, r), w);
   }
+  PIXMEM += 2*(unsigned long)w*h;  // one read and one write per pixel
   //SHOW
 }
 
+//HIDE
+// Blend kernel.
+//
+// The exact result is clamp(b*p1 + a*p2) computed in double precision.
+// The fixed-point kernel computes v = B*p1 + A*p2 with B = b*2^k and
+// A = a*2^k rounded to 16-bit integers, and rounds v/2^k, 16 pixels at
+// a time.  The rounding errors of A and B bound the distance between
+// v/2^k and the exact value, so where the fraction of v/2^k + 1/2 is
+// farther than that (E/2^k) from an integer, both round alike.  The few
+// pixels that are too close to call, or that would exceed maxval, are
+// recomputed with the exact formula: the result is always bit-exact.
+
+#ifdef __SSE2__
+typedef struct {
+  int k;     // fixed-point shift
+  int A, B;  // weights of p2 and p1, times 2^k
+  int E;     // error bound of B*p1 + A*p2, times 2^k
+} BlendFix;
+
+// Find fixed-point parameters for weights a, b.
+// Returns 0 if they do not fit the kernel (negative or too large).
+static int BlendFixInit(BlendFix* bf, double a, double b) {
+  if (!(a >= 0.0 && b >= 0.0)) return 0;
+  for (int k = 15; k >= 10; k--) {
+    double sa = a * (1 << k);
+    double sb = b * (1 << k);
+    if (sa + 0.5 >= 32768.0 || sb + 0.5 >= 32768.0) continue;
+    bf->k = k;
+    bf->A = (int)(sa + 0.5);
+    bf->B = (int)(sb + 0.5);
+    double err = (bf->A > sa ? bf->A - sa : sa - bf->A)
+               + (bf->B > sb ? bf->B - sb : sb - bf->B);
+    bf->E = (int)(err * PixMax) + 2;  // +1 for truncation, +1 for double rounding
+    return 1;
+  }
+  return 0;
+}
+
+// Blend n pixels of row p2 into row p1 with the fixed-point kernel.
+// Returns the number of pixels processed (a multiple of 16).
+static int BlendRowFixed(uint8* p1, const uint8* p2, int n,
+                         double a, double b, uint8 maxval, const BlendFix* bf) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i coef = _mm_set1_epi32((bf->A << 16) | bf->B);  // (p1,p2) pairs
+  const __m128i half = _mm_set1_epi32(1 << (bf->k - 1));
+  const __m128i frac = _mm_set1_epi32((1 << bf->k) - 1);
+  const __m128i low = _mm_set1_epi32(bf->E);
+  const __m128i high = _mm_set1_epi32((1 << bf->k) - bf->E - 1);
+  const __m128i shift = _mm_cvtsi32_si128(bf->k);
+  const __m128i top = _mm_set1_epi16(maxval);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v1 = _mm_loadu_si128((const __m128i*)(p1 + i));
+    __m128i v2 = _mm_loadu_si128((const __m128i*)(p2 + i));
+    __m128i q[4];
+    __m128i lo1 = _mm_unpacklo_epi8(v1, zero);
+    __m128i lo2 = _mm_unpacklo_epi8(v2, zero);
+    __m128i hi1 = _mm_unpackhi_epi8(v1, zero);
+    __m128i hi2 = _mm_unpackhi_epi8(v2, zero);
+    q[0] = _mm_madd_epi16(_mm_unpacklo_epi16(lo1, lo2), coef);
+    q[1] = _mm_madd_epi16(_mm_unpackhi_epi16(lo1, lo2), coef);
+    q[2] = _mm_madd_epi16(_mm_unpacklo_epi16(hi1, hi2), coef);
+    q[3] = _mm_madd_epi16(_mm_unpackhi_epi16(hi1, hi2), coef);
+    __m128i u[4];
+    for (int t = 0; t < 4; t++) {
+      q[t] = _mm_add_epi32(q[t], half);
+      __m128i f = _mm_and_si128(q[t], frac);
+      u[t] = _mm_or_si128(_mm_cmplt_epi32(f, low), _mm_cmpgt_epi32(f, high));
+      q[t] = _mm_srl_epi32(q[t], shift);
+    }
+    __m128i r0 = _mm_packs_epi32(q[0], q[1]);
+    __m128i r1 = _mm_packs_epi32(q[2], q[3]);
+    __m128i u0 = _mm_or_si128(_mm_packs_epi32(u[0], u[1]), _mm_cmpgt_epi16(r0, top));
+    __m128i u1 = _mm_or_si128(_mm_packs_epi32(u[2], u[3]), _mm_cmpgt_epi16(r1, top));
+    int unsafe = _mm_movemask_epi8(_mm_packs_epi16(u0, u1));
+    _mm_storeu_si128((__m128i*)(p1 + i), _mm_packus_epi16(r0, r1));
+    if (unsafe != 0) {
+      uint8 orig[16];
+      _mm_storeu_si128((__m128i*)orig, v1);
+      for (int t = 0; t < 16; t++) {
+        if (unsafe & (1 << t)) {
+          p1[i+t] = clamp(b * (double)orig[t] + a * (double)p2[i+t], maxval);
+        }
+      }
+    }
+  }
+  return i;
+}
+#endif
+//SHOW
+
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
@@ -633,25 +1897,248 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   //HIDE
   int w = img2->width;
   int h = img2->height;
-  int i, j;
+  Modified(img1);
   // scale factor to map img2 maxval to img1 maxval
   double scale = (double)img1->maxval / (double)img2->maxval;
   double a = alpha * scale;
   double b = (1 - alpha);
-  for (i = 0; i < w; i++) {
-    for (j = 0; j < h; j++) {
-      uint8 p1 = ImageGetPixel(img1, x+i, y+j);
-      uint8 p2 = ImageGetPixel(img2, i, j);
-      // using 2 LUTs would be faster!
-      // PIXMEM already counted by Get and Set!
-      PIXOPS += 3;  // 2 mults + 1 add
-      uint8 p0 = clamp(b * (double)p1 + a * (double)p2, img1->maxval);
-      ImageSetPixel(img1, x+i, y+j, p0);
+  uint8 maxval = img1->maxval;
+#ifdef __SSE2__
+  BlendFix bf = { 0, 0, 0, 0 };
+  int fixed = (0.0 <= alpha && alpha <= 1.0) && BlendFixInit(&bf, a, b);
+#endif
+  for (int j = 0; j < h; j++) {
+    uint8* p1 = PixelPtr(img1, x, y+j);
+    const uint8* p2 = PixelPtr(img2, 0, j);
+    int i = 0;
+#ifdef __SSE2__
+    if (fixed) i = BlendRowFixed(p1, p2, w, a, b, maxval, &bf);
+#endif
+    for (; i < w; i++) {
+      p1[i] = clamp(b * (double)p1[i] + a * (double)p2[i], maxval);
     }
   }
+  PIXMEM += 3*(unsigned long)w*h;  // 2 reads + 1 write per pixel
+  PIXOPS += 3*(unsigned long)w*h;  // 2 mults + 1 add per pixel
   //SHOW
 }
 
+//HIDE
+// Subimage search kernels.
+//
+// Candidate positions are compared by hash before pixels.  The hash of
+// the w x h window at (x, y) is a polynomial in two variables (mod 2^64):
+//   rh(x, y) = sum_i p(x+i, y) * B^(w-1-i)    hash of w pixels of a row
+//   H(x, y)  = sum_j rh(x, y+j) * C^(h-1-j)   hash of h row hashes
+// rh rolls in O(1) from x to x+1, and H from y to y+1.  Scanning x-major
+// (for the same first match as an exhaustive search), the row hashes of
+// all rows at column x are kept in an array, and rolled to x+1 after
+// each column.  So the search takes O(W*H) time, plus one exact
+// comparison per hash hit.
+
+// Hash multipliers (odd, with well mixed bits).
+#define HASHB 0x9E3779B97F4A7C15ull
+#define HASHC 0xC2B2AE3D27D4EB4Full
+
+// Compare img2 with the subimage of img1 at (x, y), row by row.
+// Adds the number of pixels compared to *cmp.
+// Requires: img2 fits inside img1 at (x, y).
+static int MatchRows(Image img1, int x, int y, Image img2, unsigned long* cmp) {
+  int w = img2->width;
+  for (int j = 0; j < img2->height; j++) {
+    *cmp += (unsigned long)w;  // count as if all pixels of the row were read
+    if (memcmp(PixelPtr(img1, x, y+j), PixelPtr(img2, 0, j), w) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// b^e (mod 2^64).
+static uint64_t Pow64(uint64_t b, int e) {
+  uint64_t r = 1;
+  for (; e > 0; e >>= 1, b *= b) {
+    if (e & 1) r *= b;
+  }
+  return r;
+}
+
+// Hash of the w pixels of a row starting at p.
+static inline uint64_t RowHash(const uint8* p, int w) {
+  uint64_t r = 0;
+  for (int i = 0; i < w; i++) r = r*HASHB + p[i];
+  return r;
+}
+
+// Matches found in one band of columns.
+typedef struct {
+  ImagePos* pos;      // positions, in x-major order
+  int n, cap;         // used and allocated size of pos
+  int oom;            // out of memory?
+  uint64_t sad;       // least SAD of pos[0] (approximate search)
+  unsigned long mem;  // pixel accesses (for PIXMEM)
+  unsigned long ops;  // pixel operations (for PIXOPS)
+} LocateList;
+
+// A parallel search job: the nx candidate columns are split in nb bands.
+typedef struct {
+  Image img1, img2;
+  int nx;
+  int nb;
+  int first;          // stop at the first match (in x-major order)?
+  int limit;          // if first: columns x >= limit need not be searched
+  LocateList* list;   // one per band
+} LocateJob;
+
+// Record a match in list.  Returns 0 if out of memory.
+static int LocateAdd(LocateList* list, int x, int y) {
+  if (list->n == list->cap) {
+    int cap = list->cap == 0 ? 16 : 2*list->cap;
+    ImagePos* pos = (ImagePos*)realloc(list->pos, (size_t)cap*sizeof(ImagePos));
+    if (pos == NULL) {
+      list->oom = 1;
+      return 0;
+    }
+    list->pos = pos;
+    list->cap = cap;
+  }
+  list->pos[list->n++] = (ImagePos){ x, y };
+  return 1;
+}
+
+// Search band b of columns, in x-major order.
+// In first mode, the search stops at the first match, or when some other
+// band has found a match in a lower column.
+static void LocateBand(void* arg, int b) {
+  LocateJob* job = (LocateJob*)arg;
+  LocateList* list = &job->list[b];
+  Image img1 = job->img1;
+  Image img2 = job->img2;
+  int H = img1->height;
+  int w = img2->width;
+  int h = img2->height;
+  int x0 = Band(job->nx, job->nb, b);
+  int x1 = Band(job->nx, job->nb, b+1);
+  if (x0 >= x1) return;
+  uint64_t* rh = (uint64_t*)malloc((size_t)H*sizeof(uint64_t));
+  if (rh == NULL) {
+    list->oom = 1;
+    return;
+  }
+  uint64_t bw = Pow64(HASHB, w-1);
+  uint64_t ch = Pow64(HASHC, h-1);
+
+  // Hash of img2.
+  uint64_t target = 0;
+  for (int j = 0; j < h; j++) {
+    target = target*HASHC + RowHash(PixelPtr(img2, 0, j), w);
+  }
+  // Row hashes at column x0.
+  for (int y = 0; y < H; y++) {
+    rh[y] = RowHash(PixelPtr(img1, x0, y), w);
+  }
+  list->mem += (unsigned long)w*(H+h);
+
+  unsigned long cmp = 0;
+  int go = 1;
+  for (int x = x0; go && x < x1; x++) {
+    if (job->first && x >= __atomic_load_n(&job->limit, __ATOMIC_RELAXED)) break;
+    // Roll the column hash down column x.
+    uint64_t hash = 0;
+    for (int j = 0; j < h; j++) hash = hash*HASHC + rh[j];
+    for (int y = 0; go; y++) {
+      if (hash == target && MatchRows(img1, x, y, img2, &cmp)) {
+        go = LocateAdd(list, x, y) && !job->first;
+        if (job->first) {
+          // Lower the limit for the other bands.
+          int limit = __atomic_load_n(&job->limit, __ATOMIC_RELAXED);
+          while (x < limit && !__atomic_compare_exchange_n(&job->limit, &limit, x,
+                     0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+        }
+      }
+      if (y+h >= H) break;
+      hash = (hash - rh[y]*ch)*HASHC + rh[y+h];
+    }
+    // Roll the row hashes to column x+1.
+    if (go && x+1 < x1) {
+      const uint8* p = img1->pixel + x;
+      for (int y = 0; y < H; y++, p += img1->stride) {
+        rh[y] = (rh[y] - p[0]*bw)*HASHB + p[w];
+      }
+      list->mem += 2*(unsigned long)H;  // 2 reads per row
+    }
+    list->ops += 4*(unsigned long)H;  // roll row and column hashes
+  }
+  list->mem += 2*cmp;
+  list->ops += cmp;
+  free(rh);
+}
+
+// Search img2 inside img1, splitting the columns among threads.
+// On return, job->list[b] has the matches in band b, for b < job->nb.
+// The caller must free the lists with LocateFree, even on failure.
+// Returns 0 if out of memory (for any band), 1 otherwise.
+// Requires: img2 is not empty and fits inside img1.
+static int LocateRun(LocateJob* job, Image img1, Image img2, int first) {
+  job->img1 = img1;
+  job->img2 = img2;
+  job->nx = img1->width - img2->width + 1;
+  // Split columns in bands, one per thread (but at least a few columns each).
+  job->nb = max(1, min(nthreads, job->nx/8));
+  job->first = first;
+  job->limit = job->nx;
+  job->list = (LocateList*)calloc((size_t)job->nb, sizeof(LocateList));
+  if (job->list == NULL) {
+    job->nb = 0;
+    return 0;
+  }
+  ParallelRun(LocateBand, job, job->nb);
+  int ok = 1;
+  for (int b = 0; b < job->nb; b++) {
+    PIXMEM += job->list[b].mem;
+    PIXOPS += job->list[b].ops;
+    ok = ok && !job->list[b].oom;
+  }
+  return ok;
+}
+
+// Free the lists of the nb bands of a search.
+static void LocateFree(LocateList* list, int nb) {
+  for (int b = 0; b < nb; b++) {
+    free(list[b].pos);
+  }
+  free(list);
+}
+
+// Concatenate the matches of the nb bands in list, in order, up to max of
+// them, into a new array *ppos (NULL if none).  ok is 0 if some band ran out
+// of memory.  Returns the number of matches, or -1 on failure.
+static int LocateGather(LocateList* list, int nb, int ok, int max, ImagePos** ppos) {
+  int n = 0;
+  for (int b = 0; ok && b < nb; b++) {
+    n += list[b].n;
+  }
+  if (ok && n > max) {
+    n = max;
+  }
+  ImagePos* pos = NULL;
+  if (ok && n > 0) {
+    ok = check( (pos = (ImagePos*)malloc((size_t)n*sizeof(ImagePos))) != NULL, "Alloc positions failed" );
+  } else if (!ok) {
+    errno = ENOMEM;  // (malloc may have failed on another thread)
+    check(0, "Alloc locate buffers failed");
+  }
+  for (int b = 0, k = 0; ok && b < nb && k < n; b++) {
+    int m = min(list[b].n, n-k);
+    memcpy(pos + k, list[b].pos, (size_t)m*sizeof(ImagePos));
+    k += m;
+  }
+  if (!ok) return -1;
+  *ppos = pos;
+  return n;
+}
+//SHOW
+
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
@@ -664,16 +2151,11 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   if (!ImageValidPos(img1, x+img2->width-1, y+img2->height-1)) {
     return 0;
   }
-  int i, j;
-  for (i = 0; i < img2->width; i++) {
-    for (j = 0; j < img2->height; j++) {
-      PIXOPS += 1;  // 1 comparison
-      if (ImageGetPixel(img1, x+i, y+j) != ImageGetPixel(img2, i, j)) {
-        return 0;
-      }
-    }
-  }
-  return 1;
+  unsigned long cmp = 0;
+  int r = MatchRows(img1, x, y, img2, &cmp);
+  PIXMEM += 2*cmp;
+  PIXOPS += cmp;
+  return r;
   //SHOW
 }
 
@@ -686,87 +2168,1433 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
   assert (img2 != NULL);
   // Insert your code here!
   //HIDE
-  int x, y;
-  for (x = 0; x <= img1->width-img2->width; x++) {
-    for (y = 0; y <= img1->height-img2->height; y++) {
-      if (ImageMatchSubImage(img1, x, y, img2)) {
-        *px = x;
-        *py = y;
-        return 1;
+  if (img2->width == 0 || img2->height == 0) return 0;  // never matches
+  if (img2->width > img1->width || img2->height > img1->height) return 0;
+  LocateJob job;
+  int ok = LocateRun(&job, img1, img2, 1);
+  int found = 0;
+  for (int b = 0; ok && b < job.nb && !found; b++) {
+    if (job.list[b].n > 0) {
+      *px = job.list[b].pos[0].x;
+      *py = job.list[b].pos[0].y;
+      found = 1;
+    }
+  }
+  LocateFree(job.list, job.nb);
+  if (!ok) {
+    // Out of memory for the hashes: scan exhaustively.
+    unsigned long cmp = 0;
+    for (int x = 0; x <= img1->width-img2->width && !found; x++) {
+      for (int y = 0; y <= img1->height-img2->height; y++) {
+        if (MatchRows(img1, x, y, img2, &cmp)) {
+          *px = x;
+          *py = y;
+          found = 1;
+          break;
+        }
       }
     }
+    PIXMEM += 2*cmp;
+    PIXOPS += cmp;
   }
-  return 0;
+  return found;
   //SHOW
 }
 
-
-/// Filtering
+/// Locate all occurrences of a subimage inside another image.
+/// Searches for img2 inside img1, in parallel (see ImageSetThreads).
+/// On success, returns the number of matches, and *ppos is set to a new
+/// array with their positions, ordered by x, then y (the order in which
+/// ImageLocateSubImage meets them).  If there are no matches, *ppos is NULL.
+/// (The caller is responsible for freeing the array!)
+/// If first is nonzero, the search stops at the first match, which is
+/// the one ImageLocateSubImage would return.
+/// On failure (out of memory), returns -1 and errno/errCause are set
+/// appropriately.
+int ImageLocateAll(Image img1, Image img2, int first, ImagePos** ppos) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ppos != NULL);
+  //HIDE
+  *ppos = NULL;
+  if (img2->width == 0 || img2->height == 0) return 0;  // never matches
+  if (img2->width > img1->width || img2->height > img1->height) return 0;
+  LocateJob job;
+  int ok = LocateRun(&job, img1, img2, first);
+  int n = LocateGather(job.list, job.nb, ok, first ? 1 : INT_MAX, ppos);
+  LocateFree(job.list, job.nb);
+  return n;
+  //SHOW
+}
 
 //HIDE
-static inline int max(int a, int b) { return a >= b ? a : b; }
-static inline int min(int a, int b) { return a <= b ? a : b; }
-//SHOW
-/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
-/// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) { ///
-  // Insert your code here!
-  //HIDE
-  // Allocate array for cummulative sums
-  int w = img->width;
-  int h = img->height;
-  uint32_t* cumsum = (uint32_t*)calloc(w*h, sizeof(*cumsum));
-  // check(cumsum != NULL, "Out of memory");
-  
-  // Compute cumsums
-  int k = 0;
-  //printf("----\n");
-  for (int y = 0; y < h; y++) {
-    for (int x = 0; x < w; x++) {
-      assert( k == G(img, x, y) );
-      PIXMEM += 4; PIXOPS += 3;
-      cumsum[k] =
-          (uint32_t)img->pixel[k]
-          + (y > 0 ? cumsum[k-w] : 0u)
-          + (x > 0 ? cumsum[k-1] : 0u)
-          - (x > 0 && y >0 ? cumsum[k-w-1] : 0u);
-      //printf("%7ud\t", cumsum[k]);
-      k++;
-    }
-    //printf("\n");
-  }
-  //printf("----\n");
-
-  // Compute diffs
-  k = 0;
-  for (int y = 0; y < h; y++) {
-    // BUG FIX:
-    //   y1 = -1 is allowed, with cumsum[x,-1] = 0
-    //   x1 = -1 is allowed, with cumsum[-1,y] = 0.
-    // TODO: redefine cumsum to be (w+1)x(h+1) and avoid conditionals.
-    int y1 = max(y-dy-1, -1);
-    int y2 = min(y+dy, h-1);
-    for (int x = 0; x < w; x++) {
-      assert( k == G(img, x, y) );
-      int x1 = max(x-dx-1, -1);
-      int x2 = min(x+dx, w-1);
-      PIXMEM += 4; PIXOPS += 3;
-      uint32_t diff =
-          cumsum[G(img, x2, y2)] 
-          - (x1 >= 0 ? cumsum[G(img, x1, y2)] : 0u)
-          - (y1 >= 0 ? cumsum[G(img, x2, y1)] : 0u)
-          + (x1 >= 0 && y1 >= 0 ? cumsum[G(img, x1, y1)] : 0u);
-      uint32_t area = (x2-x1)*(y2-y1);
-      PIXMEM += 1; PIXOPS += 3;
-      img->pixel[k] = (uint8)((2*diff + area) / (2*area));  // round
-      //printf("pixel(%d,%d) = %u / %u ~ %hhu\n", x, y, diff, area, img->pixel[k]);
-      k++;
-    }
-  }
-
-  free(cumsum);
+// Pyramid search.
+//
+// Level l of the pyramid of an image holds the means of its aligned
+// 2^l x 2^l blocks, each computed from the 2x2 block means of level l-1,
+// with a fixed rounding.  If img2 matches img1 at (x, y), take s = 2^l and
+// the phase (ox, oy) such that x+ox and y+oy are multiples of s: then the
+// part of img2 from (ox, oy) made of whole blocks has a level l that
+// matches level l of img1 at ((x+ox)/s, (y+oy)/s), because its blocks hold
+// the same pixels.  So, for each of the s*s phases, candidate positions are
+// those where level l of img1 has the value of one block of that template
+// level; the block whose value is rarest in img1 is chosen, using an index
+// of the pixels of level l by value.  Each candidate is checked at level l,
+// and then at level 0.
+// The pyramid and index of img1 are cached in it, until it is modified.
+
+#define PYRLEVELS 3
+
+struct pyramid {
+  int levels;                        // number of levels built (besides 0)
+  Image level[PYRLEVELS+1];          // level[l], for l = 1..levels
+  uint32_t* index[PYRLEVELS+1];      // positions in level[l] by value, or NULL
+  uint32_t start[PYRLEVELS+1][257];  // level value v is at index[l][start[v]..start[v+1]-1]
+};
+
+static void PyramidFree(struct pyramid* pyr) {
+  if (pyr == NULL) return;
+  for (int l = 1; l <= pyr->levels; l++) {
+    ImageDestroy(&pyr->level[l]);
+    free(pyr->index[l]);
+  }
+  free(pyr);
+}
+
+// Set dst to the 2x2 block means of src (dst is at most half its size).
+// Mean of a, b (top) and c, d (bottom) = avg(avg(a, c), avg(b, d)),
+// where avg rounds up, as _mm_avg_epu8 does.
+static void Halve(Image src, Image dst) {
+  int w = dst->width;
+  for (int y = 0; y < dst->height; y++) {
+    const uint8* r0 = PixelPtr(src, 0, 2*y);
+    const uint8* r1 = PixelPtr(src, 0, 2*y+1);
+    uint8* d = PixelPtr(dst, 0, y);
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i even = _mm_set1_epi16(0x00ff);
+    for (; x + 16 <= w; x += 16) {
+      __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(r0 + 2*x)),
+                               _mm_loadu_si128((const __m128i*)(r1 + 2*x)));
+      __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(r0 + 2*x + 16)),
+                               _mm_loadu_si128((const __m128i*)(r1 + 2*x + 16)));
+      a = _mm_avg_epu16(_mm_and_si128(a, even), _mm_srli_epi16(a, 8));
+      b = _mm_avg_epu16(_mm_and_si128(b, even), _mm_srli_epi16(b, 8));
+      _mm_storeu_si128((__m128i*)(d + x), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; x < w; x++) {
+      int a = (r0[2*x] + r1[2*x] + 1) >> 1;
+      int b = (r0[2*x+1] + r1[2*x+1] + 1) >> 1;
+      d[x] = (uint8)((a + b + 1) >> 1);
+    }
+  }
+  PIXMEM += 5*(unsigned long)w*dst->height;  // 4 reads and 1 write per pixel
+}
+
+// Get the pyramid of img: its cached one, if valid, or a new empty one
+// (cached in img, unless it is a view).  Returns NULL on failure.
+// Release it with PyramidRelease.
+static struct pyramid* PyramidGet(Image img) {
+  if (img->pyrValid) return img->pyr;
+  if (!img->view) {
+    PyramidFree(img->pyr);
+    img->pyr = NULL;
+  }
+  struct pyramid* pyr = (struct pyramid*)calloc(1, sizeof(*pyr));
+  if (pyr != NULL && !img->view) {
+    img->pyr = pyr;
+    img->pyrValid = 1;
+  }
+  return pyr;
+}
+
+static void PyramidRelease(Image img, struct pyramid* pyr) {
+  if (img->view) PyramidFree(pyr);  // views do not cache
+}
+
+// Make sure pyr has levels 1..l of img.  Returns 0 on failure.
+static int PyramidBuild(struct pyramid* pyr, Image img, int l) {
+  for (; pyr->levels < l; pyr->levels++) {
+    Image src = pyr->levels == 0 ? img : pyr->level[pyr->levels];
+    Image dst = ImageAlloc(src->width/2, src->height/2, img->maxval, 0);
+    if (dst == NULL) return 0;
+    Halve(src, dst);
+    pyr->level[pyr->levels+1] = dst;
+    pyr->index[pyr->levels+1] = NULL;
+  }
+  return 1;
+}
+
+// Make sure pyr has the index of its level l.  Returns 0 on failure.
+static int PyramidIndex(struct pyramid* pyr, int l) {
+  if (pyr->index[l] != NULL) return 1;
+  // Index the pixels of the level by value (counting sort).
+  Image lev = pyr->level[l];
+  size_t n = (size_t)lev->width*lev->height;
+  uint32_t* start = pyr->start[l];
+  uint32_t* index = NULL;
+  if (!check( n <= UINT32_MAX, "Image too large to index" ) ||
+      !check( (index = (uint32_t*)malloc(n*sizeof(uint32_t) + 1)) != NULL, "Alloc pyramid index failed" )) {
+    return 0;
+  }
+  memset(start, 0, 257*sizeof(uint32_t));
+  for (int y = 0; y < lev->height; y++) {
+    const uint8* row = PixelPtr(lev, 0, y);
+    for (int x = 0; x < lev->width; x++) start[row[x]+1]++;
+  }
+  uint32_t next[256];
+  for (int v = 0; v < 256; v++) {
+    start[v+1] += start[v];
+    next[v] = start[v];
+  }
+  for (int y = 0; y < lev->height; y++) {
+    const uint8* row = PixelPtr(lev, 0, y);
+    for (int x = 0; x < lev->width; x++) index[next[row[x]]++] = (uint32_t)y*lev->width + x;
+  }
+  PIXMEM += 2*(unsigned long)n;
+  pyr->index[l] = index;
+  return 1;
+}
+
+// Search img2 in img1 with the level l of pyramid pyr of img1.
+// Sets (*px, *py) to the first match (as in ImageLocateSubImage), if any.
+// Returns 1 if found, 0 if not, or -1 on failure or if there are too many
+// candidates (so that an exhaustive search is better).
+static int PyramidSearch(struct pyramid* pyr, int l, Image img1, int* px, int* py, Image img2) {
+  int s = 1 << l;
+  Image lev = pyr->level[l];
+  const uint32_t* index = pyr->index[l];
+  const uint32_t* start = pyr->start[l];
+  // Give up beyond a few candidates per position.
+  long long budget = (long long)(img1->width - img2->width + 1) * (img1->height - img2->height + 1) / 4;
+  long long candidates = 0;
+  int bestx = INT_MAX, besty = INT_MAX;
+  unsigned long cmp = 0;
+  int ok = 1;
+  for (int oy = 0; ok && oy < s; oy++) {
+    for (int ox = 0; ok && ox < s; ox++) {
+      int cw = (img2->width - ox) / s;
+      int ch = (img2->height - oy) / s;
+      // Levels 0..l of the whole blocks of img2 from (ox, oy).
+      Image tmp[PYRLEVELS+1] = { NULL };
+      ok = (tmp[0] = ImageCreateView(img2, ox, oy, cw*s, ch*s)) != NULL;
+      for (int k = 1; ok && k <= l; k++) {
+        ok = (tmp[k] = ImageAlloc(cw*s >> k, ch*s >> k, img2->maxval, 0)) != NULL;
+        if (ok) Halve(tmp[k-1], tmp[k]);
+      }
+      Image t = tmp[l];
+      // The template block with the rarest value in level l of img1.
+      int rx = 0, ry = 0;
+      uint32_t fewest = UINT32_MAX;
+      for (int j = 0; ok && j < ch; j++) {
+        for (int i = 0; i < cw; i++) {
+          uint8 v = *PixelPtr(t, i, j);
+          if (start[v+1] - start[v] < fewest) {
+            fewest = start[v+1] - start[v];
+            rx = i;
+            ry = j;
+          }
+        }
+      }
+      uint8 v = ok ? *PixelPtr(t, rx, ry) : 0;
+      candidates += fewest;
+      if (candidates > budget) ok = 0;
+      for (uint32_t c = start[v]; ok && c < start[v+1]; c++) {
+        int X = (int)(index[c] % (uint32_t)lev->width) - rx;
+        int Y = (int)(index[c] / (uint32_t)lev->width) - ry;
+        int x = X*s - ox;
+        int y = Y*s - oy;
+        if (x < 0 || y < 0 || x + img2->width > img1->width || y + img2->height > img1->height) continue;
+        if (x > bestx || (x == bestx && y >= besty)) continue;
+        if (MatchRows(lev, X, Y, t, &cmp) && MatchRows(img1, x, y, img2, &cmp)) {
+          bestx = x;
+          besty = y;
+        }
+      }
+      for (int k = 0; k <= l; k++) ImageDestroy(&tmp[k]);
+    }
+  }
+  PIXMEM += 2*cmp;
+  PIXOPS += cmp;
+  if (!ok) return -1;
+  if (bestx == INT_MAX) return 0;
+  *px = bestx;
+  *py = besty;
+  return 1;
+}
+//SHOW
+
+/// Locate a subimage inside another image, with a coarse-to-fine search.
+/// Same as ImageLocateSubImage (with the same result).
+int ImageLocateSubImagePyramid(Image img1, int* px, int* py, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  //HIDE
+  if (img2->width == 0 || img2->height == 0) return 0;  // never matches
+  if (img2->width > img1->width || img2->height > img1->height) return 0;
+  // The coarsest level at which every phase has a whole block of img2.
+  int l = 0;
+  while (l < PYRLEVELS && 2*(2 << l) - 1 <= min(img2->width, img2->height)) l++;
+  int found = -1;
+  errsave = errno;  // failures here are not errors: see below
+  struct pyramid* pyr = l > 0 ? PyramidGet(img1) : NULL;
+  if (pyr != NULL && PyramidBuild(pyr, img1, l) && PyramidIndex(pyr, l)) {
+    found = PyramidSearch(pyr, l, img1, px, py, img2);
+  }
+  if (pyr != NULL) PyramidRelease(img1, pyr);
+  errno = errsave;
+  if (found < 0) {
+    // No pyramid, or it does not discriminate: search exhaustively.
+    found = ImageLocateSubImage(img1, px, py, img2);
+  }
+  return found;
+  //SHOW
+}
+
+//HIDE
+// Approximate subimage search.
+//
+// The cost of a position is the sum of absolute differences (SAD) between
+// img2 and the window of img1 at that position.  It is accumulated row by
+// row with psadbw, and abandoned as soon as it exceeds a limit: the best
+// cost so far, or the threshold.  The difference between the pixel sums of
+// img2 and of the window is a lower bound of the SAD, so most positions are
+// skipped without reading the window.  Window sums roll in O(1) per
+// position, like the hashes of the exact search (row sums at column x,
+// rolled to x+1 after each column).  To get a tight limit early, each band
+// first computes the SAD of its position with the least lower bound.
+
+typedef struct {
+  Image img1, img2;
+  int nx;
+  int nb;
+  int all;            // find all positions with SAD <= maxsad (or the best)?
+  uint64_t maxsad;
+  uint64_t best;      // least SAD found by any band so far
+  LocateList* list;   // one per band (pos[0] is its best, if not all)
+} SadJob;
+
+// SAD of the n pixels at p and q.
+static inline uint64_t SadRow(const uint8* p, const uint8* q, int n) {
+  uint64_t sad = 0;
+  int i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(p + i)),
+                                          _mm_loadu_si128((const __m128i*)(q + i))));
+  }
+  if (i + 8 <= n) {
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadl_epi64((const __m128i*)(p + i)),
+                                          _mm_loadl_epi64((const __m128i*)(q + i))));
+    i += 8;
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  sad = lanes[0] + lanes[1];
+#endif
+  for (; i < n; i++) {
+    sad += (uint64_t)(p[i] > q[i] ? p[i] - q[i] : q[i] - p[i]);
+  }
+  return sad;
+}
+
+// SAD of img2 and the window of img1 at (x, y), or UINT64_MAX if it
+// exceeds limit (the remaining rows are not compared).
+// Adds the number of pixels compared to *cmp.
+// Requires: img2 fits inside img1 at (x, y).
+static uint64_t SadRows(Image img1, int x, int y, Image img2, uint64_t limit, unsigned long* cmp) {
+  int w = img2->width;
+  uint64_t sad = 0;
+  for (int j = 0; j < img2->height; j++) {
+    *cmp += (unsigned long)w;
+    sad += SadRow(PixelPtr(img1, x, y+j), PixelPtr(img2, 0, j), w);
+    if (sad > limit) return UINT64_MAX;
+  }
+  return sad;
+}
+
+// Set rs[y] to the sum of the w pixels of row y of img1 from column x.
+static void RowSums(Image img1, int x, int w, uint64_t* rs) {
+  for (int y = 0; y < img1->height; y++) {
+    const uint8* p = PixelPtr(img1, x, y);
+    uint64_t r = 0;
+    for (int i = 0; i < w; i++) r += p[i];
+    rs[y] = r;
+  }
+}
+
+// Roll the row sums rs of w pixels from column x to column x+1.
+static void RollRowSums(Image img1, int x, int w, uint64_t* rs) {
+  const uint8* p = img1->pixel + x;
+  for (int y = 0; y < img1->height; y++, p += img1->stride) {
+    rs[y] = rs[y] - p[0] + p[w];
+  }
+}
+
+// Lower bound of the SAD of two sets of pixels with sums a and b.
+static inline uint64_t SadBound(uint64_t a, uint64_t b) {
+  return a > b ? a - b : b - a;
+}
+
+// Search band b of columns, in x-major order.
+static void SadBand(void* arg, int b) {
+  SadJob* job = (SadJob*)arg;
+  LocateList* list = &job->list[b];
+  Image img1 = job->img1;
+  Image img2 = job->img2;
+  int H = img1->height;
+  int w = img2->width;
+  int h = img2->height;
+  int x0 = Band(job->nx, job->nb, b);
+  int x1 = Band(job->nx, job->nb, b+1);
+  list->sad = UINT64_MAX;
+  if (x0 >= x1) return;
+  uint64_t* rs = (uint64_t*)malloc((size_t)H*sizeof(uint64_t));
+  if (rs == NULL) {
+    list->oom = 1;
+    return;
+  }
+  uint64_t target = 0;
+  for (int j = 0; j < h; j++) {
+    const uint8* q = PixelPtr(img2, 0, j);
+    for (int i = 0; i < w; i++) target += q[i];
+  }
+  list->mem += (unsigned long)w*h;
+
+  unsigned long cmp = 0;
+  int bx = x0, by = 0;  // best position of the band (if !all)
+  if (!job->all && job->best == UINT64_MAX) {
+    // No seed from a coarse search: seed with the position of least
+    // lower bound.
+    uint64_t least = UINT64_MAX;
+    RowSums(img1, x0, w, rs);
+    for (int x = x0; x < x1; x++) {
+      uint64_t sum = 0;
+      for (int j = 0; j < h; j++) sum += rs[j];
+      for (int y = 0; ; y++) {
+        if (SadBound(sum, target) < least) {
+          least = SadBound(sum, target);
+          bx = x;
+          by = y;
+        }
+        if (y+h >= H) break;
+        sum = sum - rs[y] + rs[y+h];
+      }
+      if (x+1 < x1) RollRowSums(img1, x, w, rs);
+    }
+    list->sad = SadRows(img1, bx, by, img2, UINT64_MAX, &cmp);
+    list->mem += 2*(unsigned long)H*(x1-x0) + (unsigned long)w*H;
+    list->ops += 3*(unsigned long)H*(x1-x0);
+  }
+
+  RowSums(img1, x0, w, rs);
+  list->mem += (unsigned long)w*H;
+  for (int x = x0; x < x1; x++) {
+    uint64_t sum = 0;
+    for (int j = 0; j < h; j++) sum += rs[j];
+    for (int y = 0; ; y++) {
+      uint64_t limit = job->maxsad;
+      int skip = 0;
+      if (!job->all) {
+        // Positions before the best of the band may tie with it, positions
+        // after it must beat it, and none may exceed the best of any band.
+        int after = x > bx || (x == bx && y >= by);
+        skip = after && list->sad == 0;
+        limit = list->sad - after;
+        uint64_t best = __atomic_load_n(&job->best, __ATOMIC_RELAXED);
+        if (best < limit) limit = best;
+      }
+      if (!skip && SadBound(sum, target) <= limit) {
+        uint64_t sad = SadRows(img1, x, y, img2, limit, &cmp);
+        if (sad <= limit) {
+          if (job->all) {
+            if (!LocateAdd(list, x, y)) break;
+          } else {
+            list->sad = sad;
+            bx = x;
+            by = y;
+            uint64_t best = __atomic_load_n(&job->best, __ATOMIC_RELAXED);
+            while (sad < best && !__atomic_compare_exchange_n(&job->best, &best, sad,
+                       0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+          }
+        }
+      }
+      if (y+h >= H) break;
+      sum = sum - rs[y] + rs[y+h];
+    }
+    if (list->oom) break;
+    if (x+1 < x1) {
+      RollRowSums(img1, x, w, rs);
+      list->mem += 2*(unsigned long)H;
+    }
+    list->ops += 3*(unsigned long)H;  // roll row and window sums, bound
+  }
+  if (!job->all && !list->oom && list->sad != UINT64_MAX) {
+    LocateAdd(list, bx, by);
+  }
+  list->mem += 2*cmp;
+  list->ops += 2*cmp;  // 1 difference + 1 sum per pixel
+  free(rs);
+}
+
+static int SadRun(SadJob* job, Image img1, Image img2, int all, uint64_t maxsad);
+
+// The band of job with the best position (the first of least SAD), or -1.
+static int SadBest(SadJob* job) {
+  int b0 = -1;
+  for (int b = 0; b < job->nb; b++) {
+    if (job->list[b].n > 0 && (b0 < 0 || job->list[b].sad < job->list[b0].sad)) b0 = b;
+  }
+  return b0;
+}
+
+// Set job->best to the SAD of a good position, found by a search at a
+// coarse level of the pyramids of job->img1 and job->img2, followed by a
+// search at full resolution around it.  The pyramid of img1 is cached.
+// (Best effort: on failure, job->best is left unchanged.)
+static void SadSeed(SadJob* job) {
+  Image img1 = job->img1;
+  Image img2 = job->img2;
+  int l = 0;
+  while (l < 2 && (img2->width >> (l+1)) >= 4 && (img2->height >> (l+1)) >= 4) l++;
+  if (l == 0) return;
+  int s = 1 << l;
+  int errnum = errno;  // (not errsave: the coarse search seeds itself too)
+  struct pyramid* pyr1 = PyramidGet(img1);
+  struct pyramid* pyr2 = (struct pyramid*)calloc(1, sizeof(*pyr2));
+  if (pyr1 != NULL && pyr2 != NULL && PyramidBuild(pyr1, img1, l) && PyramidBuild(pyr2, img2, l)) {
+    // img2 (from (0, 0)) at (x, y) is near level-l block (x/s, y/s).
+    SadJob coarse;
+    int X = -1, Y = -1;
+    if (SadRun(&coarse, pyr1->level[l], pyr2->level[l], 0, 0)) {
+      int b0 = SadBest(&coarse);
+      if (b0 >= 0) {
+        X = coarse.list[b0].pos[0].x;
+        Y = coarse.list[b0].pos[0].y;
+      }
+    }
+    LocateFree(coarse.list, coarse.nb);
+    unsigned long cmp = 0;
+    for (int x = max(0, (X-1)*s+1); X >= 0 && x < min(job->nx, (X+1)*s); x++) {
+      for (int y = max(0, (Y-1)*s+1); y <= min(img1->height - img2->height, (Y+1)*s-1); y++) {
+        uint64_t sad = SadRows(img1, x, y, img2, job->best, &cmp);
+        if (sad < job->best) job->best = sad;
+      }
+    }
+    PIXMEM += 2*cmp;
+    PIXOPS += 2*cmp;
+  }
+  if (pyr1 != NULL) PyramidRelease(img1, pyr1);
+  PyramidFree(pyr2);
+  errno = errnum;
+}
+
+// Run an approximate search of img2 inside img1 (see SadJob).
+// Returns 0 if out of memory (for any band), 1 otherwise.
+// The caller must free the lists with LocateFree, even on failure.
+// Requires: img2 is not empty and fits inside img1.
+static int SadRun(SadJob* job, Image img1, Image img2, int all, uint64_t maxsad) {
+  job->img1 = img1;
+  job->img2 = img2;
+  job->nx = img1->width - img2->width + 1;
+  job->nb = max(1, min(nthreads, job->nx/8));
+  job->all = all;
+  job->maxsad = maxsad;
+  job->best = UINT64_MAX;
+  job->list = (LocateList*)calloc((size_t)job->nb, sizeof(LocateList));
+  if (job->list == NULL) {
+    job->nb = 0;
+    return 0;
+  }
+  if (!all) SadSeed(job);
+  ParallelRun(SadBand, job, job->nb);
+  int ok = 1;
+  for (int b = 0; b < job->nb; b++) {
+    PIXMEM += job->list[b].mem;
+    PIXOPS += job->list[b].ops;
+    ok = ok && !job->list[b].oom;
+  }
+  return ok;
+}
+//SHOW
+
+/// Locate the best approximate match of a subimage inside another image.
+/// Searches, in parallel (see ImageSetThreads), the position (x, y) of img1
+/// where the sum of absolute differences (SAD) of its pixels and those of
+/// img2 is least (the first one, in the order of ImageLocateSubImage, if
+/// there are ties).  Use it when img2 may not match exactly (e.g., after
+/// a lossy operation).
+/// If img2 fits inside img1 (and is not empty), returns 1, and sets
+/// (*px, *py) to that position, and *psad to its SAD (if psad is not NULL).
+/// Otherwise, returns 0 and leaves them untouched.
+/// On failure (out of memory), returns -1 and errno/errCause are set
+/// appropriately.
+int ImageLocateSubImageApprox(Image img1, int* px, int* py, Image img2, uint64_t* psad) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  //HIDE
+  if (img2->width == 0 || img2->height == 0) return 0;
+  if (img2->width > img1->width || img2->height > img1->height) return 0;
+  SadJob job;
+  int ok = SadRun(&job, img1, img2, 0, 0);
+  int b0 = ok ? SadBest(&job) : -1;
+  if (b0 >= 0) {
+    *px = job.list[b0].pos[0].x;
+    *py = job.list[b0].pos[0].y;
+    if (psad != NULL) *psad = job.list[b0].sad;
+  } else if (!ok) {
+    errno = ENOMEM;  // (malloc may have failed on another thread)
+    check(0, "Alloc locate buffers failed");
+  }
+  LocateFree(job.list, job.nb);
+  return ok ? 1 : -1;
+  //SHOW
+}
+
+/// Locate all approximate matches of a subimage inside another image.
+/// Like ImageLocateAll, but reports all positions of img1 where the sum of
+/// absolute differences (SAD) of its pixels and those of img2 is at most
+/// maxsad.  (With maxsad = 0, they are the exact matches.)
+int ImageLocateAllApprox(Image img1, Image img2, uint64_t maxsad, ImagePos** ppos) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ppos != NULL);
+  //HIDE
+  *ppos = NULL;
+  if (img2->width == 0 || img2->height == 0) return 0;
+  if (img2->width > img1->width || img2->height > img1->height) return 0;
+  SadJob job;
+  int ok = SadRun(&job, img1, img2, 1, maxsad);
+  int n = LocateGather(job.list, job.nb, ok, INT_MAX, ppos);
+  LocateFree(job.list, job.nb);
+  return n;
+  //SHOW
+}
+
+
+/// Integral images
+
+//HIDE
+// An integral image (summed-area table) of a w x h image holds, at
+// [y*(w+1) + x], the sum of the pixels of the rectangle [0, x)x[0, y), so
+// its first row and column are 0 and any rectangle sum takes 4 lookups.
+// It is built on horizontal bands of rows, in parallel:
+// 1. Each band computes the sums of its own rows (as if the rows above
+//    were 0).
+// 2. Going down, the last row of each band gets the (by then global) last
+//    row of the previous band added: a serial, but O(width), step.
+// 3. Each band adds the last row of the previous band to its other rows.
+
+struct integral {
+  int width, height;  // image size
+  uint64_t* sum;      // (width+1)x(height+1) sums of levels
+  uint64_t* sq;       // (width+1)x(height+1) sums of squared levels, or NULL
+};
+
+// Position of sum (x, y) in the tables.
+static inline size_t IntegralPos(Integral ii, int x, int y) {
+  return (size_t)y*(ii->width+1) + x;
+}
+
+// A parallel build or blur job, split in nb bands.
+typedef struct {
+  Integral ii;
+  Image img;
+  int dx, dy;
+  int nb;
+} IntegralJob;
+
+// Step 1, for band b: sums of image rows [y0, y1), taking rows above y0 as 0.
+static void IntegralJobSums(void* arg, int b) {
+  IntegralJob* job = (IntegralJob*)arg;
+  Integral ii = job->ii;
+  int w = ii->width;
+  int y0 = Band(ii->height, job->nb, b);
+  int y1 = Band(ii->height, job->nb, b+1);
+  for (int y = y0; y < y1; y++) {
+    const uint8* row = PixelPtr(job->img, 0, y);
+    uint64_t* s = ii->sum + IntegralPos(ii, 1, y+1);
+    const uint64_t* above = y > y0 ? s - (w+1) : NULL;
+    uint64_t r = 0;
+    s[-1] = 0;
+    for (int x = 0; x < w; x++) {
+      r += row[x];
+      s[x] = r + (above != NULL ? above[x] : 0);
+    }
+    if (ii->sq != NULL) {
+      s = ii->sq + IntegralPos(ii, 1, y+1);
+      above = y > y0 ? s - (w+1) : NULL;
+      r = 0;
+      s[-1] = 0;
+      for (int x = 0; x < w; x++) {
+        r += (uint64_t)row[x]*row[x];
+        s[x] = r + (above != NULL ? above[x] : 0);
+      }
+    }
+  }
+}
+
+// Add the row of table t at carry to rows [y0, y1) of t.
+static void IntegralCarry(Integral ii, uint64_t* t, int carry, int y0, int y1) {
+  const uint64_t* c = t + IntegralPos(ii, 1, carry);
+  for (int y = y0; y < y1; y++) {
+    uint64_t* s = t + IntegralPos(ii, 1, y);
+    for (int x = 0; x < ii->width; x++) s[x] += c[x];
+  }
+}
+
+// Step 3, for band b.  (Image row y is table row y+1.)
+static void IntegralJobCarry(void* arg, int b) {
+  IntegralJob* job = (IntegralJob*)arg;
+  if (b == 0) return;
+  Integral ii = job->ii;
+  int y0 = Band(ii->height, job->nb, b);
+  int y1 = Band(ii->height, job->nb, b+1);
+  IntegralCarry(ii, ii->sum, y0, y0+1, y1);
+  if (ii->sq != NULL) IntegralCarry(ii, ii->sq, y0, y0+1, y1);
+}
+
+// Blur rows [y0, y1) of the image of job, from its integral image.
+static void IntegralJobBlur(void* arg, int b) {
+  IntegralJob* job = (IntegralJob*)arg;
+  Integral ii = job->ii;
+  int w = ii->width;
+  int h = ii->height;
+  int dx = min(job->dx, w);
+  int y0 = Band(h, job->nb, b);
+  int y1 = Band(h, job->nb, b+1);
+  for (int y = y0; y < y1; y++) {
+    // The window is [x-dx, x+dx]x[y-dy, y+dy], clipped to the image.
+    int wy1 = max(y-job->dy, 0);
+    int wy2 = min(y+job->dy, h-1) + 1;
+    const uint64_t* c1 = ii->sum + IntegralPos(ii, 0, wy1);
+    const uint64_t* c2 = ii->sum + IntegralPos(ii, 0, wy2);
+    uint8* row = PixelPtr(job->img, 0, y);
+    for (int x = 0; x < w; x++) {
+      int wx1 = max(x-dx, 0);
+      int wx2 = min(x+dx, w-1) + 1;
+      uint64_t diff = c2[wx2] - c2[wx1] - c1[wx2] + c1[wx1];
+      uint64_t area = (uint64_t)(wx2-wx1)*(wy2-wy1);
+      row[x] = (uint8)((2*diff + area) / (2*area));  // round
+    }
+  }
+}
+//SHOW
+
+/// Create the integral image (summed-area table) of img.
+/// It holds 64-bit sums of the gray levels of img, and also of their
+/// squares if squares is nonzero, so that sums, means (and variances) of
+/// any rectangle take constant time.  It takes 8 bytes per pixel (16 with
+/// squares), and is built in parallel (see ImageSetThreads).
+/// It is a snapshot: later changes to img do not change it.
+/// On success, a new integral image is returned.
+/// (The caller is responsible for destroying the returned object!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Integral IntegralCreate(Image img, int squares) { ///
+  assert (img != NULL);
+  //HIDE
+  int w = img->width;
+  int h = img->height;
+  size_t n = (size_t)(w+1)*(h+1);
+  Integral ii = NULL;
+  if (!check( (ii = (Integral)calloc(1, sizeof(*ii))) != NULL, "Alloc integral failed" )) {
+    return NULL;
+  }
+  ii->width = w;
+  ii->height = h;
+  if (!check( (ii->sum = (uint64_t*)malloc(n*sizeof(uint64_t))) != NULL, "Alloc integral failed" ) ||
+      (squares && !check( (ii->sq = (uint64_t*)malloc(n*sizeof(uint64_t))) != NULL, "Alloc integral failed" ))) {
+    IntegralDestroy(&ii);
+    return NULL;
+  }
+  // Zero first row (the bands zero the first column).
+  memset(ii->sum, 0, (size_t)(w+1)*sizeof(uint64_t));
+  if (ii->sq != NULL) memset(ii->sq, 0, (size_t)(w+1)*sizeof(uint64_t));
+  // Split rows in bands, one per thread (but at least a few rows each).
+  IntegralJob job = { ii, img, 0, 0, max(1, min(nthreads, h/8)) };
+  ParallelRun(IntegralJobSums, &job, job.nb);
+  if (job.nb > 1) {
+    // Make the last row of each band global, band after band.
+    for (int b = 1; b < job.nb; b++) {
+      int carry = Band(h, job.nb, b);
+      int last = Band(h, job.nb, b+1);
+      IntegralCarry(ii, ii->sum, carry, last, last+1);
+      if (ii->sq != NULL) IntegralCarry(ii, ii->sq, carry, last, last+1);
+    }
+    ParallelRun(IntegralJobCarry, &job, job.nb);
+  }
+  int k = squares ? 2 : 1;
+  PIXMEM += (1 + 2*k)*(unsigned long)w*h;  // 1 read + (1 read + 1 write) per table
+  PIXOPS += 2*k*(unsigned long)w*h;        // 2 adds per table
+  return ii;
+  //SHOW
+}
+
+/// Destroy the integral image pointed to by (*pii).
+///   pii : address of an Integral variable.
+/// If (*pii)==NULL, no operation is performed.
+/// Ensures: (*pii)==NULL.
+void IntegralDestroy(Integral* pii) { ///
+  assert (pii != NULL);
+  //HIDE
+  if (*pii != NULL) {
+    free((*pii)->sum);
+    free((*pii)->sq);
+  }
+  free(*pii);
+  *pii = NULL;
+  //SHOW
+}
+
+/// Size of the image of the integral image.
+int IntegralWidth(Integral ii) { ///
+  assert (ii != NULL);
+  return ii->width;
+}
+
+int IntegralHeight(Integral ii) { ///
+  assert (ii != NULL);
+  return ii->height;
+}
+
+/// Check if rectangle [x, x+w)x[y, y+h) is inside the image of ii.
+/// (Empty rectangles are valid.)
+int IntegralValidRect(Integral ii, int x, int y, int w, int h) { ///
+  assert (ii != NULL);
+  //HIDE
+  return 0 <= x && 0 <= w && w <= ii->width - x &&
+         0 <= y && 0 <= h && h <= ii->height - y;
+  //SHOW
+}
+
+/// Sum of the gray levels of the rectangle [x, x+w)x[y, y+h).
+/// Requires: IntegralValidRect(ii, x, y, w, h).
+uint64_t IntegralSum(Integral ii, int x, int y, int w, int h) { ///
+  assert (ii != NULL);
+  assert (IntegralValidRect(ii, x, y, w, h));
+  //HIDE
+  const uint64_t* s = ii->sum;
+  return s[IntegralPos(ii, x+w, y+h)] - s[IntegralPos(ii, x, y+h)]
+       - s[IntegralPos(ii, x+w, y)] + s[IntegralPos(ii, x, y)];
+  //SHOW
+}
+
+/// Mean of the gray levels of the rectangle [x, x+w)x[y, y+h).
+/// Requires: IntegralValidRect(ii, x, y, w, h), and w, h > 0.
+double IntegralMean(Integral ii, int x, int y, int w, int h) { ///
+  assert (w > 0 && h > 0);
+  return (double)IntegralSum(ii, x, y, w, h) / ((double)w*h);
+}
+
+/// Variance (population) of the gray levels of the rectangle
+/// [x, x+w)x[y, y+h).
+/// Requires: ii was created with squares,
+/// IntegralValidRect(ii, x, y, w, h), and w, h > 0.
+double IntegralVariance(Integral ii, int x, int y, int w, int h) { ///
+  assert (ii != NULL);
+  assert (ii->sq != NULL);
+  assert (IntegralValidRect(ii, x, y, w, h));
+  assert (w > 0 && h > 0);
+  //HIDE
+  const uint64_t* q = ii->sq;
+  uint64_t sq = q[IntegralPos(ii, x+w, y+h)] - q[IntegralPos(ii, x, y+h)]
+              - q[IntegralPos(ii, x+w, y)] + q[IntegralPos(ii, x, y)];
+  double n = (double)w*h;
+  double mean = (double)IntegralSum(ii, x, y, w, h) / n;
+  double var = (double)sq / n - mean*mean;
+  return var > 0.0 ? var : 0.0;  // (rounding may make it slightly negative)
+  //SHOW
+}
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter, using its
+/// integral image ii.  Same result as ImageBlur(img, dx, dy), if ii was
+/// created from img.  Since ii is not changed, it can be reused to blur
+/// other copies of img, with other window sizes.
+/// Runs in parallel (see ImageSetThreads).
+/// Requires: img has the size of ii.
+void IntegralBlur(Integral ii, Image img, int dx, int dy) { ///
+  assert (ii != NULL);
+  assert (img != NULL);
+  assert (img->width == ii->width && img->height == ii->height);
+  assert (dx >= 0 && dy >= 0);
+  //HIDE
+  int w = img->width;
+  int h = img->height;
+  Modified(img);
+  IntegralJob job = { ii, img, dx, dy, max(1, min(nthreads, h/8)) };
+  ParallelRun(IntegralJobBlur, &job, job.nb);
+  PIXMEM += 5*(unsigned long)w*h;  // 4 sums + 1 store
+  PIXOPS += 6*(unsigned long)w*h;  // 3 diffs + 3 to round
+  //SHOW
+}
+
+
+/// Filtering
+
+//HIDE
+// Streaming blur kernels.
+//
+// ImageBlur is separable: for each row, the horizontal window sums are
+// taken from the row prefix sums, and the vertical window sums of those
+// are kept up to date as rows enter (at the bottom) and leave (at the top)
+// the window.  A BlurStream does this for rows fed top to bottom, keeping
+// a copy of the last 2dy+2 input rows, so its memory is O(w*dy) whatever
+// the image height, and it may overwrite input rows with output rows.
+// The window sums are 64-bit, so results are exact for any image size.
+//
+// For parallel runs, each band gets its own stream.  The halo rows
+// (the dy rows above and below the band) are fed or copied before any
+// band starts writing its rows.
+
+typedef struct {
+  int w, h;       // image size
+  int dx, dy;     // window half-sizes (clipped to the image)
+  int y;          // next output row
+  int r;          // next input row
+  int lo;         // first row still in the vertical sums
+  int nring;      // number of rows in ring
+  uint8* ring;    // copies of the last nring input rows (row r at r%nring)
+  uint64_t* pre;  // prefix sums of a row (w+1)
+  uint64_t* vs;   // vertical sums of horizontal window sums of rows [lo, r)
+} BlurStream;
+
+// Init stream to produce rows from y0 on.  Input must start at row max(0, y0-dy).
+// Returns 0 on allocation failure.
+static int BlurStreamInit(BlurStream* bs, int w, int h, int dx, int dy, int y0) {
+  bs->w = w;
+  bs->h = h;
+  bs->dx = min(dx, w > 0 ? w-1 : 0);
+  bs->dy = min(dy, h > 0 ? h-1 : 0);
+  bs->y = y0;
+  bs->r = bs->lo = max(0, y0 - bs->dy);
+  bs->nring = 2*bs->dy + 2;
+  bs->ring = (uint8*)malloc((size_t)bs->nring*w + 1);
+  bs->pre = (uint64_t*)malloc((w + 1)*sizeof(uint64_t));
+  bs->vs = (uint64_t*)calloc(w + 1, sizeof(uint64_t));
+  return bs->ring != NULL && bs->pre != NULL && bs->vs != NULL;
+}
+
+static void BlurStreamFree(BlurStream* bs) {
+  free(bs->ring);
+  free(bs->pre);
+  free(bs->vs);
+}
+
+// Add (sign>0) or subtract (sign<0) the horizontal window sums of row to vs.
+static void BlurStreamAddRow(BlurStream* bs, const uint8* row, int sign) {
+  int w = bs->w;
+  int dx = bs->dx;
+  uint64_t* pre = bs->pre;
+  uint64_t* vs = bs->vs;
+  pre[0] = 0;
+  for (int x = 0; x < w; x++) pre[x+1] = pre[x] + row[x];
+  // Window of x is [max(0,x-dx), min(w,x+dx+1)): split x by clipping.
+  int xa = min(dx, w);          // x < xa: clipped on the left
+  int xb = max(w - dx - 1, xa); // x >= xb: clipped on the right
+  int x = 0;
+  if (sign > 0) {
+    for (; x < xa; x++) vs[x] += pre[min(x+dx+1, w)];
+    for (; x < xb; x++) vs[x] += pre[x+dx+1] - pre[x-dx];
+    for (; x < w; x++) vs[x] += pre[w] - pre[x-dx];
+  } else {
+    for (; x < xa; x++) vs[x] -= pre[min(x+dx+1, w)];
+    for (; x < xb; x++) vs[x] -= pre[x+dx+1] - pre[x-dx];
+    for (; x < w; x++) vs[x] -= pre[w] - pre[x-dx];
+  }
+}
+
+// Feed the next input row.
+static void BlurStreamPush(BlurStream* bs, const uint8* row) {
+  memcpy(bs->ring + (size_t)(bs->r % bs->nring)*bs->w, row, bs->w);
+  BlurStreamAddRow(bs, row, +1);
+  bs->r++;
+}
+
+// Is the next output row ready (all rows of its window fed)?
+static int BlurStreamReady(const BlurStream* bs) {
+  return bs->y < bs->h && bs->r >= min(bs->y + bs->dy + 1, bs->h);
+}
+
+// Produce the next output row (when ready) into out.
+// out may be the input row with the same number: it was copied to the ring.
+static void BlurStreamPop(BlurStream* bs, uint8* out) {
+  int w = bs->w;
+  int dx = bs->dx;
+  // Drop rows above the window.
+  for (; bs->lo < bs->y - bs->dy; bs->lo++) {
+    BlurStreamAddRow(bs, bs->ring + (size_t)(bs->lo % bs->nring)*w, -1);
+  }
+  // Each pixel is the rounded mean of its window: (2*sum + area)/(2*area).
+  // As doubles, sum/area is exact at ties and too far from them to round
+  // wrongly: the result is floor(sum/area + 1/2), for area < 2^40.
+  int rows = min(bs->y + bs->dy, bs->h - 1) - max(bs->y - bs->dy, 0) + 1;
+  for (int x = 0; x < w; x++) {
+    int cols = min(x + dx, w - 1) - max(x - dx, 0) + 1;
+    double area = (double)cols * rows;
+    out[x] = (uint8)((double)bs->vs[x] / area + 0.5);
+  }
+  bs->y++;
+}
+
+// A parallel streaming blur job, split in nb bands.
+typedef struct {
+  Image img;
+  int dx, dy;
+  int nb;
+  BlurStream* bs;  // the stream of each band
+  uint8** halo;    // copies of the rows below each band
+} StreamJob;
+
+// Step 1, for band b: feed the rows above the band, copy the rows below.
+static void StreamJobHalo(void* arg, int b) {
+  StreamJob* job = (StreamJob*)arg;
+  Image img = job->img;
+  BlurStream* bs = &job->bs[b];
+  int y0 = Band(img->height, job->nb, b);
+  int y1 = Band(img->height, job->nb, b+1);
+  for (int r = bs->r; r < y0; r++) {
+    BlurStreamPush(bs, PixelPtr(img, 0, r));
+  }
+  int y2 = min(y1 + bs->dy, img->height);
+  for (int r = y1; r < y2; r++) {
+    memcpy(job->halo[b] + (size_t)(r-y1)*img->width, PixelPtr(img, 0, r), img->width);
+  }
+}
+
+// Step 2, for band b: stream the band rows, then the halo rows below.
+static void StreamJobRows(void* arg, int b) {
+  StreamJob* job = (StreamJob*)arg;
+  Image img = job->img;
+  BlurStream* bs = &job->bs[b];
+  int w = img->width;
+  int y1 = Band(img->height, job->nb, b+1);
+  while (bs->y < y1) {
+    if (BlurStreamReady(bs)) {
+      BlurStreamPop(bs, PixelPtr(img, 0, bs->y));
+    } else if (bs->r < y1) {
+      BlurStreamPush(bs, PixelPtr(img, 0, bs->r));
+    } else {
+      BlurStreamPush(bs, job->halo[b] + (size_t)(bs->r - y1)*w);
+    }
+  }
+}
+//SHOW
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].
+/// The image is changed in-place.
+/// This uses a streaming separable filter, with O(width*dy) extra memory.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// appropriately, and the image is left unchanged.
+int ImageBlur(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  // Insert your code here!
+  //HIDE
+  int w = img->width;
+  int h = img->height;
+  Modified(img);
+  int nb = max(1, min(nthreads, h/8));
+  BlurStream bs[nb];
+  uint8* halo[nb];
+  StreamJob job = { img, dx, dy, nb, bs, halo };
+  int success = 1;
+  int b;
+  for (b = 0; b < nb && success; b++) {
+    halo[b] = NULL;
+    success =
+    check( BlurStreamInit(&bs[b], w, h, dx, dy, Band(h, nb, b)), "Alloc blur buffers failed" ) &&
+    check( (halo[b] = (uint8*)malloc((size_t)min(dy, h)*w + 1)) != NULL, "Alloc blur buffers failed" );
+  }
+  if (success) {
+    ParallelRun(StreamJobHalo, &job, nb);
+    ParallelRun(StreamJobRows, &job, nb);
+    PIXMEM += 2*(unsigned long)w*h;  // 1 read + 1 write per pixel
+    PIXOPS += 6*(unsigned long)w*h;  // 2 adds + 2 subs per row pass + 2 to round
+  } else {
+    errsave = errno;
+  }
+  // Cleanup
+  while (b-- > 0) {
+    BlurStreamFree(&bs[b]);
+    free(halo[b]);
+  }
+  if (!success) errno = errsave;
+  return success;
+  //SHOW
+}
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Same as ImageBlur, but using an integral image (see IntegralCreate),
+/// which takes 8 bytes of extra memory per pixel.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// appropriately, and the image is left unchanged.
+int ImageBlurIntegral(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  //HIDE
+  Integral ii = IntegralCreate(img, 0);
+  if (ii == NULL) return 0;
+  IntegralBlur(ii, img, dx, dy);
+  IntegralDestroy(&ii);
+  return 1;
+  //SHOW
+}
+
+
+/// Strip pipelines
+
+//HIDE
+// A pipeline is a chain of stages.  Each stage takes rows (of its input
+// size) one at a time, and passes its output rows, as they become
+// available, to the next stage.  Rows are passed as writable buffers
+// owned by the pipeline, so a stage may change a row in-place.  The input
+// file is read in strips of rows, and the output of the last stage is
+// collected in strips and written as soon as each strip is full.
+//
+// Memory is O(strip height * width) for the strips, plus O(width) per
+// stage, plus O(width * dy) per blur.
+
+enum { STAGE_MAP, STAGE_MIRROR, STAGE_CROP, STAGE_BLUR };
+
+typedef struct {
+  int kind;
+  int w, h;         // size of input rows
+  int y;            // number of input rows received
+  uint8* row;       // output row (MIRROR and BLUR)
+  uint8 map[256];   // MAP: the pixel map (consecutive maps are fused)
+  MapShape ms;      // MAP: its shape (classified when run)
+  int cx, cy;       // CROP: position of the rectangle
+  int cw, ch;       // CROP: size of the rectangle
+  BlurStream bs;    // BLUR: the blur stream
+} Stage;
+
+struct pipeline {
+  FILE* f;          // input file, after the header
+  int width, height;// input image size
+  int maxval;       // maximum gray level (of input and output)
+  int w, h;         // output image size (of the last stage)
+  int nstages;      // number of stages
+  int cap;          // allocated size of stage
+  Stage* stage;     // the stages
+  int run;          // has the pipeline run?
+  // While running:
+  FILE* out;        // output file
+  uint8* strip;     // output strip
+  int rows;         // rows per strip
+  int nrows;        // rows in strip
+  int done;         // number of output rows written
+};
+
+// Append a new stage, taking rows of the current output size.
+// Returns NULL on failure, with errno/errCause set.
+static Stage* PipelineAdd(Pipeline p, int kind) {
+  if (p->nstages == p->cap) {
+    int cap = p->cap == 0 ? 8 : 2*p->cap;
+    Stage* stage = NULL;
+    if (!check( (stage = (Stage*)realloc(p->stage, (size_t)cap*sizeof(Stage))) != NULL, "Alloc stage failed" )) {
+      return NULL;
+    }
+    p->stage = stage;
+    p->cap = cap;
+  }
+  Stage* st = &p->stage[p->nstages++];
+  memset(st, 0, sizeof(*st));
+  st->kind = kind;
+  st->w = p->w;
+  st->h = p->h;
+  return st;
+}
+
+// Get the map of the last stage, if a MAP stage, or else of a new one.
+// Returns NULL on failure, with errno/errCause set.
+static uint8* PipelineMap(Pipeline p) {
+  if (p->nstages > 0 && p->stage[p->nstages-1].kind == STAGE_MAP) {
+    return p->stage[p->nstages-1].map;
+  }
+  Stage* st = PipelineAdd(p, STAGE_MAP);
+  if (st == NULL) return NULL;
+  PixMapInit(st->map);
+  return st->map;
+}
+
+// Write row to the output strip, and the strip to the file when full.
+// Returns 0 on failure, with errno/errCause set.
+static int PipelineSink(Pipeline p, const uint8* row) {
+  size_t w = (size_t)p->w;
+  memcpy(p->strip + p->nrows*w, row, w);
+  p->done++;
+  if (++p->nrows == p->rows || p->done == p->h) {
+    if (!check( fwrite(p->strip, sizeof(uint8), p->nrows*w, p->out) == p->nrows*w, "Writing pixels failed" )) {
+      return 0;
+    }
+    PIXMEM += (unsigned long)(p->nrows*w);  // count pixel memory accesses
+    p->nrows = 0;
+  }
+  return 1;
+}
+
+// Pass the next input row of stage s (which may change it) down the pipeline.
+// Returns 0 on failure, with errno/errCause set.
+static int PipelineRow(Pipeline p, int s, uint8* row) {
+  if (s == p->nstages) return PipelineSink(p, row);
+  Stage* st = &p->stage[s];
+  int w = st->w;
+  int y = st->y++;
+  switch (st->kind) {
+  case STAGE_MAP:
+    MapPixels(row, w, st->map, &st->ms);
+    PIXMEM += 2*(unsigned long)w;  // one read and one write per pixel
+    return PipelineRow(p, s+1, row);
+  case STAGE_MIRROR:
+    ReverseRow(row, st->row, w);
+    PIXMEM += 2*(unsigned long)w;  // one read and one write per pixel
+    return PipelineRow(p, s+1, st->row);
+  case STAGE_CROP:
+    if (y < st->cy || y >= st->cy + st->ch) return 1;
+    return PipelineRow(p, s+1, row + st->cx);
+  case STAGE_BLUR:
+    BlurStreamPush(&st->bs, row);
+    while (BlurStreamReady(&st->bs)) {
+      BlurStreamPop(&st->bs, st->row);
+      PIXMEM += 2*(unsigned long)w;  // 1 read + 1 write per pixel
+      PIXOPS += 6*(unsigned long)w;  // 2 adds + 2 subs per row pass + 2 to round
+      if (!PipelineRow(p, s+1, st->row)) return 0;
+    }
+    return 1;
+  }
+  return 1;
+}
+//SHOW
+
+/// Open a raw PGM file as the input of a strip pipeline.
+/// The pipeline starts with no operations: operations are added with
+/// PipelineNegative, ..., PipelineBlur, and then applied by PipelineRun.
+/// On success, a new pipeline is returned.
+/// (The caller is responsible for destroying the returned pipeline!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Pipeline PipelineOpen(const char* filename) { ///
+  //HIDE
+  int w, h;
+  int maxval;
+  FILE* f = NULL;
+  Pipeline p = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  readHeader(f, &w, &h, &maxval) &&
+  check( (p = (Pipeline)calloc(1, sizeof(*p))) != NULL, "Alloc pipeline failed" );
+  if (success) {
+    p->f = f;
+    p->width = p->w = w;
+    p->height = p->h = h;
+    p->maxval = maxval;
+  } else {
+    errsave = errno;
+    if (f != NULL) fclose(f);
+    errno = errsave;
+  }
+  return p;
+  //SHOW
+}
+
+/// Destroy the pipeline pointed to by (*pp), closing its input.
+///   pp : address of a Pipeline variable.
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void PipelineDestroy(Pipeline* pp) { ///
+  assert (pp != NULL);
+  //HIDE
+  Pipeline p = *pp;
+  if (p != NULL) {
+    for (int s = 0; s < p->nstages; s++) {
+      free(p->stage[s].row);
+      if (p->stage[s].kind == STAGE_BLUR) BlurStreamFree(&p->stage[s].bs);
+    }
+    free(p->stage);
+    errsave = errno;
+    fclose(p->f);
+    errno = errsave;
+  }
+  free(p);
+  *pp = NULL;
+  //SHOW
+}
+
+/// Get the width of the images produced by the pipeline (so far).
+int PipelineWidth(Pipeline p) { ///
+  assert (p != NULL);
+  return p->w;
+}
+
+/// Get the height of the images produced by the pipeline (so far).
+int PipelineHeight(Pipeline p) { ///
+  assert (p != NULL);
+  return p->h;
+}
+
+/// Check if rectangular area (x,y,w,h) is inside the images produced by the
+/// pipeline (so far).  Same rules as ImageValidRect.
+int PipelineValidRect(Pipeline p, int x, int y, int w, int h) { ///
+  assert (p != NULL);
+  //HIDE
+  return 0 <= x && x < p->w && 0 <= y && y < p->h &&
+         0 <= x+w-1 && x+w-1 < p->w && 0 <= y+h-1 && y+h-1 < p->h;
+  //SHOW
+}
+
+/// Pipeline operations
+
+/// These append an operation to the pipeline, with the same effect as the
+/// Image operation of the same name.
+/// (Consecutive point operations are fused in a single pixel map.)
+/// On success, return nonzero.
+/// On failure (out of memory), return 0, errno/errCause are set
+/// appropriately, and the pipeline is left unchanged.
+
+/// Append ImageNegative.
+int PipelineNegative(Pipeline p) { ///
+  assert (p != NULL);
+  assert (!p->run);
+  //HIDE
+  uint8* map = PipelineMap(p);
+  if (map == NULL) return 0;
+  PixMapNegative(map, p->maxval);
+  return 1;
+  //SHOW
+}
+
+/// Append ImageThreshold.
+int PipelineThreshold(Pipeline p, uint8 thr) { ///
+  assert (p != NULL);
+  assert (!p->run);
+  //HIDE
+  uint8* map = PipelineMap(p);
+  if (map == NULL) return 0;
+  PixMapThreshold(map, thr, p->maxval);
+  return 1;
+  //SHOW
+}
+
+/// Append ImageBrighten.
+int PipelineBrighten(Pipeline p, double factor) { ///
+  assert (p != NULL);
+  assert (!p->run);
+  //HIDE
+  uint8* map = PipelineMap(p);
+  if (map == NULL) return 0;
+  PixMapAffine(map, factor, 0.0, p->maxval);
+  return 1;
+  //SHOW
+}
+
+/// Append ImageMirror.
+int PipelineMirror(Pipeline p) { ///
+  assert (p != NULL);
+  assert (!p->run);
+  //HIDE
+  Stage* st = PipelineAdd(p, STAGE_MIRROR);
+  if (st == NULL) return 0;
+  if (!check( (st->row = (uint8*)malloc((size_t)st->w + 1)) != NULL, "Alloc row failed" )) {
+    p->nstages--;
+    return 0;
+  }
+  return 1;
+  //SHOW
+}
+
+/// Append ImageCrop.
+/// Requires: (x, y, w, h) must be a valid rectangle (see PipelineValidRect).
+int PipelineCrop(Pipeline p, int x, int y, int w, int h) { ///
+  assert (p != NULL);
+  assert (!p->run);
+  assert (PipelineValidRect(p, x, y, w, h));
+  //HIDE
+  Stage* st = PipelineAdd(p, STAGE_CROP);
+  if (st == NULL) return 0;
+  st->cx = x;
+  st->cy = y;
+  st->cw = p->w = w;
+  st->ch = p->h = h;
+  return 1;
+  //SHOW
+}
+
+/// Append ImageBlur.
+int PipelineBlur(Pipeline p, int dx, int dy) { ///
+  assert (p != NULL);
+  assert (!p->run);
+  assert (dx >= 0 && dy >= 0);
+  //HIDE
+  Stage* st = PipelineAdd(p, STAGE_BLUR);
+  if (st == NULL) return 0;
+  int success =
+  check( BlurStreamInit(&st->bs, st->w, st->h, dx, dy, 0), "Alloc blur buffers failed" ) &&
+  check( (st->row = (uint8*)malloc((size_t)st->w + 1)) != NULL, "Alloc row failed" );
+  if (!success) {
+    errsave = errno;
+    BlurStreamFree(&st->bs);
+    free(st->row);
+    p->nstages--;
+    errno = errsave;
+  }
+  return success;
+  //SHOW
+}
+
+/// Run the pipeline: read the input file in strips of the given number of
+/// rows (rows <= 0 selects strips of about 1 MiB), apply the operations,
+/// and save the result to a PGM file.
+/// A pipeline runs only once.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int PipelineRun(Pipeline p, const char* filename, int rows) { ///
+  assert (p != NULL);
+  assert (!p->run);
+  //HIDE
+  p->run = 1;
+  int W = p->width;
+  if (rows <= 0) rows = max(1, (1 << 20) / max(1, max(W, p->w)));
+  p->rows = rows;
+  p->nrows = 0;
+  p->done = 0;
+  for (int s = 0; s < p->nstages; s++) {
+    if (p->stage[s].kind == STAGE_MAP) p->stage[s].ms = PixMapClassify(p->stage[s].map);
+  }
+  uint8* in = NULL;
+  p->strip = NULL;
+  p->out = NULL;
+
+  int success =
+  check( (in = (uint8*)malloc((size_t)rows*W + 1)) != NULL, "Alloc strips failed" ) &&
+  check( (p->strip = (uint8*)malloc((size_t)rows*p->w + 1)) != NULL, "Alloc strips failed" ) &&
+  check( (p->out = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(p->out, "P5\n%d %d\n%u\n", p->w, p->h, p->maxval) > 0, "Writing header failed" );
+  // Stop reading as soon as all output rows are written (after a crop).
+  for (int y = 0; success && y < p->height && p->done < p->h; ) {
+    int n = min(rows, p->height - y);
+    success = check( fread(in, sizeof(uint8), (size_t)n*W, p->f) == (size_t)n*W, "Reading pixels" );
+    PIXMEM += (unsigned long)n*W;  // count pixel memory accesses
+    for (int i = 0; success && i < n; i++) {
+      success = PipelineRow(p, 0, in + (size_t)i*W);
+    }
+    y += n;
+  }
+
+  // Cleanup
+  errsave = errno;
+  if (p->out != NULL) fclose(p->out);
+  free(p->strip);
+  free(in);
+  errno = errsave;
+  return success;
   //SHOW
 }
 
@@ -13,6 +13,7 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -23,6 +24,36 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Type Pipeline is a pointer to strip pipeline objects
+typedef struct pipeline *Pipeline;
+
+// Type Integral is a pointer to integral image (summed-area table) objects
+typedef struct integral *Integral;
+
+// A pixel position in an image
+typedef struct {
+  int x, y;
+} ImagePos;
+
+// Statistics of the gray levels of an image (see ImageHistogram)
+typedef struct {
+  uint64_t count[256];  // number of pixels with each gray level
+  uint64_t pixels;      // total number of pixels
+  uint8 min, max;       // range of gray levels (min > max if no pixels)
+  double mean;          // mean gray level
+  double variance;      // variance of the gray levels (population)
+} ImageHist;
+
+// A geometric transformation: a rotation or flip, and a crop (see ImageXform
+// functions).  Pixel (i, j) of the result is pixel
+// (x0 + xi*i + xj*j, y0 + yi*i + yj*j) of the source image.
+typedef struct {
+  int x0, y0;           // source of pixel (0, 0)
+  int xi, xj, yi, yj;   // a signed permutation matrix
+  int width, height;    // size of the result
+  int srcw, srch;       // size of the source image
+} ImageXform;
+
 /// Error handling functions
 
 /// Error cause.
@@ -36,9 +67,23 @@ typedef struct image *Image;
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply calibrate instrumentation (when first needed) and set names of counters.
 void ImageInit(void) ;
 
+/// Threads
+
+/// Some operations (currently ImageBlur, ImageBlurIntegral, ImageLocateSubImage,
+/// ImageLocateAll, their Approx variants and ImageHistogram) split their
+/// work among threads.
+/// By default, the library is single-threaded.
+
+/// Set the number of threads used by parallel operations.
+/// n <= 0 selects one thread per online processor.
+void ImageSetThreads(int n) ;
+
+/// Get the number of threads used by parallel operations.
+int ImageGetThreads(void) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -58,6 +103,32 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Set the maximum number of bytes kept in the buffer pool.
+/// When images are destroyed, their pixel buffers are kept in a pool, up to
+/// that limit, to be reused by new images of the same (or similar)
+/// dimensions.  The oldest buffers are released first.
+/// limit = 0 (the default) disables the pool and releases all buffers.
+/// The pool is shared by all threads.
+void ImagePoolSetLimit(size_t limit) ;
+
+/// Get the maximum number of bytes kept in the buffer pool.
+size_t ImagePoolLimit(void) ;
+
+/// Create a view of a rectangle of img.
+/// The view is an image that shares the pixels of the rectangle with img:
+/// any change to one is seen in the other.  Views work with all
+/// operations, and may be used to restrict in-place operations (such as
+/// ImageNegative or ImageBlur) to a region of img.
+/// Views of views are allowed.
+/// Requires: the rectangle (x, y, w, h) must be inside img.
+/// img must not be destroyed before the view.
+/// 
+/// On success, a new view is returned.
+/// (The caller is responsible for destroying the returned view, which
+/// does not affect img!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateView(Image img, int x, int y, int w, int h) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
@@ -67,6 +138,17 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load a raw PGM file by mapping it into memory.
+/// Same as ImageLoad, but the pixels are not copied: the image uses the
+/// raster in a private (copy-on-write) mapping of the file.
+/// Pixels are paged in from the file as they are accessed; changes to the
+/// image affect only the image, never the file.
+/// ImageDestroy releases the mapping.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) ;
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -93,6 +175,14 @@ int ImageMaxval(Image img) ;
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Compute the histogram and statistics of the gray levels of img
+/// into *hist, in a single pass.
+/// The result is cached in img (unless it is a view), and reused until
+/// img is modified (by any operation, or through any view), so repeated
+/// calls on an unchanged image take constant time.
+/// (ImageStats uses it too.)  Never fails.
+void ImageHistogram(Image img, ImageHist* hist) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -112,6 +202,16 @@ uint8 ImageGetPixel(Image img, int x, int y) ;
 /// Set the pixel at position (x,y) to new level.
 void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
+/// Get the address of the ImageWidth(img) pixels of row y, which are
+/// contiguous, for reading only (use ImageSetRow to change them).
+/// The address is valid until img is destroyed.
+/// Requires: 0 <= y < ImageHeight(img).
+const uint8* ImageRow(Image img, int y) ;
+
+/// Set the ImageWidth(img) pixels of row y to the levels at row.
+/// Requires: 0 <= y < ImageHeight(img), levels <= ImageMaxval(img).
+void ImageSetRow(Image img, int y, const uint8* row) ;
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -135,6 +235,32 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Pixel maps
+
+/// A pixel map is an array of 1+PixMax levels that maps each gray level p
+/// to a new level map[p].  ImageNegative, ImageThreshold and ImageBrighten
+/// are all pixel maps, so a chain of them can be composed into one map
+/// and applied in a single pass over the image, with the same result.
+/// The ImageMap* functions below compose the map of an operation, as it
+/// would be applied to img, after the given map: map[p] = op(map[p]).
+
+/// Init map with the identity map.
+void ImageMapIdentity(uint8* map) ;
+
+/// Compose ImageNegative(img) after map.
+void ImageMapNegative(Image img, uint8* map) ;
+
+/// Compose ImageThreshold(img, thr) after map.
+void ImageMapThreshold(Image img, uint8* map, uint8 thr) ;
+
+/// Compose ImageBrighten(img, factor) after map.
+void ImageMapBrighten(Image img, uint8* map, double factor) ;
+
+/// Apply pixel map to img.
+/// Each pixel level p is replaced by map[p].
+/// The image is changed in-place.
+void ImageApplyMap(Image img, const uint8* map) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +281,25 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image by 180 degrees.
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) ;
+
+/// Rotate an image by 270 degrees.
+/// Returns a rotated version of the image, the same as applying
+/// ImageRotate three times.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate270(Image img) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -164,6 +309,15 @@ Image ImageRotate(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) ;
 
+/// Flip an image upside-down.
+/// Returns a flipped version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageFlipUD(Image img) ;
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -178,6 +332,46 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Fused geometric transformations
+
+/// Chains of rotations, flips and crops need not copy the image at each
+/// step.  They may be composed into an ImageXform, with the functions
+/// below, which only do arithmetic, and then applied to the image in a
+/// single pass, which only touches the pixels of the result.
+/// For instance, for any img,
+///   ImageXformInit(&t, img); ImageXformRotate(&t); ImageXformMirror(&t);
+///   img2 = ImageXformApply(img, &t);
+/// gives the same image as ImageMirror(ImageRotate(img)).
+
+/// Init t as the identity transformation of img.
+void ImageXformInit(ImageXform* t, Image img) ;
+
+/// Compose t with ImageRotate, ImageRotate180, ImageRotate270,
+/// ImageMirror, or ImageFlipUD, respectively.
+void ImageXformRotate(ImageXform* t) ;
+void ImageXformRotate180(ImageXform* t) ;
+void ImageXformRotate270(ImageXform* t) ;
+void ImageXformMirror(ImageXform* t) ;
+void ImageXformFlipUD(ImageXform* t) ;
+
+/// Check if rectangular area (x,y,w,h) is inside the result of t.
+/// Same rules as ImageValidRect.
+int ImageXformValidRect(const ImageXform* t, int x, int y, int w, int h) ;
+
+/// Compose t with ImageCrop.
+/// Requires: ImageXformValidRect(t, x, y, w, h).
+void ImageXformCrop(ImageXform* t, int x, int y, int w, int h) ;
+
+/// Apply transformation t to img.
+/// Requires: t was composed starting from ImageXformInit(t, img),
+/// or from an image of the same size.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageXformApply(Image img, const ImageXform* t) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -205,12 +399,188 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Locate all occurrences of a subimage inside another image.
+/// Searches for img2 inside img1, in parallel (see ImageSetThreads).
+/// On success, returns the number of matches, and *ppos is set to a new
+/// array with their positions, ordered by x, then y (the order in which
+/// ImageLocateSubImage meets them).  If there are no matches, *ppos is NULL.
+/// (The caller is responsible for freeing the array!)
+/// If first is nonzero, the search stops at the first match, which is
+/// the one ImageLocateSubImage would return.
+/// On failure (out of memory), returns -1 and errno/errCause are set
+/// appropriately.
+int ImageLocateAll(Image img1, Image img2, int first, ImagePos** ppos) ;
+
+/// Locate a subimage inside another image, with a coarse-to-fine search.
+/// Same as ImageLocateSubImage (with the same result), but it builds a
+/// pyramid of downsampled versions of img1 (and img2), and only verifies
+/// the positions where they match at the coarsest level.
+/// The pyramid of img1 is cached in it (unless it is a view), until img1 is
+/// modified, so that searching several subimages in the same image builds
+/// it only once.  If the pyramid does not discriminate positions well (as
+/// in flat images), or memory is short, it falls back to ImageLocateSubImage.
+int ImageLocateSubImagePyramid(Image img1, int* px, int* py, Image img2) ;
+
+/// Locate the best approximate match of a subimage inside another image.
+/// Searches, in parallel (see ImageSetThreads), the position (x, y) of img1
+/// where the sum of absolute differences (SAD) of its pixels and those of
+/// img2 is least (the first one, in the order of ImageLocateSubImage, if
+/// there are ties).  Use it when img2 may not match exactly (e.g., after
+/// a lossy operation).
+/// If img2 fits inside img1 (and is not empty), returns 1, and sets
+/// (*px, *py) to that position, and *psad to its SAD (if psad is not NULL).
+/// Otherwise, returns 0 and leaves them untouched.
+/// On failure (out of memory), returns -1 and errno/errCause are set
+/// appropriately.
+int ImageLocateSubImageApprox(Image img1, int* px, int* py, Image img2, uint64_t* psad) ;
+
+/// Locate all approximate matches of a subimage inside another image.
+/// Like ImageLocateAll, but reports all positions of img1 where the sum of
+/// absolute differences (SAD) of its pixels and those of img2 is at most
+/// maxsad.  (With maxsad = 0, they are the exact matches.)
+int ImageLocateAllApprox(Image img1, Image img2, uint64_t maxsad, ImagePos** ppos) ;
+
+/// Integral images
+
+/// Create the integral image (summed-area table) of img.
+/// It holds 64-bit sums of the gray levels of img, and also of their
+/// squares if squares is nonzero, so that sums, means (and variances) of
+/// any rectangle take constant time.  It takes 8 bytes per pixel (16 with
+/// squares), and is built in parallel (see ImageSetThreads).
+/// It is a snapshot: later changes to img do not change it.
+/// On success, a new integral image is returned.
+/// (The caller is responsible for destroying the returned object!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Integral IntegralCreate(Image img, int squares) ;
+
+/// Destroy the integral image pointed to by (*pii).
+///   pii : address of an Integral variable.
+/// If (*pii)==NULL, no operation is performed.
+/// Ensures: (*pii)==NULL.
+void IntegralDestroy(Integral* pii) ;
+
+/// Size of the image of the integral image.
+int IntegralWidth(Integral ii) ;
+int IntegralHeight(Integral ii) ;
+
+/// Check if rectangle [x, x+w)x[y, y+h) is inside the image of ii.
+/// (Empty rectangles are valid.)
+int IntegralValidRect(Integral ii, int x, int y, int w, int h) ;
+
+/// Sum of the gray levels of the rectangle [x, x+w)x[y, y+h).
+/// Requires: IntegralValidRect(ii, x, y, w, h).
+uint64_t IntegralSum(Integral ii, int x, int y, int w, int h) ;
+
+/// Mean of the gray levels of the rectangle [x, x+w)x[y, y+h).
+/// Requires: IntegralValidRect(ii, x, y, w, h), and w, h > 0.
+double IntegralMean(Integral ii, int x, int y, int w, int h) ;
+
+/// Variance (population) of the gray levels of the rectangle
+/// [x, x+w)x[y, y+h).
+/// Requires: ii was created with squares,
+/// IntegralValidRect(ii, x, y, w, h), and w, h > 0.
+double IntegralVariance(Integral ii, int x, int y, int w, int h) ;
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter, using its
+/// integral image ii.  Same result as ImageBlur(img, dx, dy), if ii was
+/// created from img.  Since ii is not changed, it can be reused to blur
+/// other copies of img, with other window sizes.
+/// Runs in parallel (see ImageSetThreads).
+/// Requires: img has the size of ii.
+void IntegralBlur(Integral ii, Image img, int dx, int dy) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) ;
+/// This uses a streaming separable filter, with O(width*dy) extra memory.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// appropriately, and the image is left unchanged.
+int ImageBlur(Image img, int dx, int dy) ;
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Same as ImageBlur, but using an integral image (see IntegralCreate),
+/// which takes 8 bytes of extra memory per pixel.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// appropriately, and the image is left unchanged.
+int ImageBlurIntegral(Image img, int dx, int dy) ;
+
+/// Strip pipelines
+
+/// A pipeline reads a PGM file in strips of rows, passes each row through
+/// a chain of operations, and writes the resulting rows to another PGM
+/// file as soon as they are ready.  Memory depends on the image width and
+/// strip height, not on the image height, so images larger than memory
+/// can be processed.  Only operations that produce each output row from
+/// a few neighbouring input rows are available: the point operations,
+/// mirror, crop and blur.
+/// The result is the same as loading the image, applying the same
+/// operations, and saving it.
+
+/// Open a raw PGM file as the input of a strip pipeline.
+/// The pipeline starts with no operations: operations are added with
+/// PipelineNegative, ..., PipelineBlur, and then applied by PipelineRun.
+/// On success, a new pipeline is returned.
+/// (The caller is responsible for destroying the returned pipeline!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Pipeline PipelineOpen(const char* filename) ;
+
+/// Destroy the pipeline pointed to by (*pp), closing its input.
+///   pp : address of a Pipeline variable.
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void PipelineDestroy(Pipeline* pp) ;
+
+/// Get the width of the images produced by the pipeline (so far).
+int PipelineWidth(Pipeline p) ;
+
+/// Get the height of the images produced by the pipeline (so far).
+int PipelineHeight(Pipeline p) ;
+
+/// Check if rectangular area (x,y,w,h) is inside the images produced by the
+/// pipeline (so far).  Same rules as ImageValidRect.
+int PipelineValidRect(Pipeline p, int x, int y, int w, int h) ;
+
+/// Pipeline operations
+
+/// These append an operation to the pipeline, with the same effect as the
+/// Image operation of the same name.
+/// (Consecutive point operations are fused in a single pixel map.)
+/// On success, return nonzero.
+/// On failure (out of memory), return 0, errno/errCause are set
+/// appropriately, and the pipeline is left unchanged.
+
+/// Append ImageNegative.
+int PipelineNegative(Pipeline p) ;
+
+/// Append ImageThreshold.
+int PipelineThreshold(Pipeline p, uint8 thr) ;
+
+/// Append ImageBrighten.
+int PipelineBrighten(Pipeline p, double factor) ;
+
+/// Append ImageMirror.
+int PipelineMirror(Pipeline p) ;
+
+/// Append ImageCrop.
+/// Requires: (x, y, w, h) must be a valid rectangle (see PipelineValidRect).
+int PipelineCrop(Pipeline p, int x, int y, int w, int h) ;
+
+/// Append ImageBlur.
+int PipelineBlur(Pipeline p, int dx, int dy) ;
+
+/// Run the pipeline: read the input file in strips of the given number of
+/// rows (rows <= 0 selects strips of about 1 MiB), apply the operations,
+/// and save the result to a PGM file.
+/// A pipeline runs only once.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int PipelineRun(Pipeline p, const char* filename, int rows) ;
 
 #endif
@@ -0,0 +1,395 @@
+// imageBench - A benchmark of the image8bit module.
+//
+// This program is an example use of the image8bit module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// It generates synthetic images of several sizes, times each operation
+// of the module a number of times, and reports its throughput in
+// megapixels per second (mean and standard deviation over repetitions).
+// Results may be written to a CSV or JSON file, and compared with a
+// baseline CSV file, written by a previous run, to detect regressions.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include <error.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [-s SIZES] [-r REPS] [-t THREADS] [-d DIR]\n"
+    "                  [-o FILE] [-b BASELINE] [-x TOLERANCE] [OP...]\n"
+    "  Time image8bit operations on synthetic SIZExSIZE images.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -s SIZES      Comma-separated image sizes (default 256,1024,4096;\n"
+    "                up to 16384 needs about 1 GB of memory)\n"
+    "  -r REPS       Repetitions of each operation (default 5, at least 2)\n"
+    "  -t THREADS    Threads for parallel operations (default 1, 0: one per CPU)\n"
+    "  -d DIR        Directory for temporary files (default $TMPDIR or /tmp)\n"
+    "  -o FILE       Write results to FILE, in JSON if it ends in .json,\n"
+    "                or else in CSV\n"
+    "  -b BASELINE   Compare with results in CSV file BASELINE, and flag\n"
+    "                operations that got slower than TOLERANCE\n"
+    "  -x TOLERANCE  Relative slowdown to flag as regression (default 0.10)\n"
+    "  OP...         Run only these operations (default: all)\n"
+    "\n"
+    "Exit status is 1 if some regression was flagged.\n"
+    ;
+
+
+// The images and files that operations work on.
+typedef struct {
+  Image img;          // the test image
+  Image work;         // a copy of img, for operations that modify it
+  Image half;         // an image of half the size, to paste or blend
+  Image tmpl;         // a small crop near the end of img, to locate
+  char file[1024];    // a file with img saved
+  char out[1024];     // a file to save to
+} Data;
+
+// A benchmarked operation.
+// run does the operation on d, and may create an image in *out,
+// which is destroyed after it is timed.  Returns 0 on failure.
+typedef struct {
+  const char* name;
+  int inplace;        // does it modify d->work?  (It is restored each time.)
+  int quarter;        // does it process a quarter of the pixels?
+  int (*run)(Data* d, Image* out);
+} Op;
+
+static int RunLoad(Data* d, Image* out) {
+  return (*out = ImageLoad(d->file)) != NULL;
+}
+
+static int RunLoadMapped(Data* d, Image* out) {
+  return (*out = ImageLoadMapped(d->file)) != NULL;
+}
+
+static int RunSave(Data* d, Image* out) {
+  return ImageSave(d->img, d->out);
+}
+
+static int RunNegative(Data* d, Image* out) {
+  ImageNegative(d->work);
+  return 1;
+}
+
+static int RunThreshold(Data* d, Image* out) {
+  ImageThreshold(d->work, 128);
+  return 1;
+}
+
+static int RunBrighten(Data* d, Image* out) {
+  ImageBrighten(d->work, 1.3);
+  return 1;
+}
+
+static int RunRotate(Data* d, Image* out) {
+  return (*out = ImageRotate(d->img)) != NULL;
+}
+
+static int RunRotate180(Data* d, Image* out) {
+  return (*out = ImageRotate180(d->img)) != NULL;
+}
+
+static int RunRotate270(Data* d, Image* out) {
+  return (*out = ImageRotate270(d->img)) != NULL;
+}
+
+static int RunMirror(Data* d, Image* out) {
+  return (*out = ImageMirror(d->img)) != NULL;
+}
+
+static int RunFlip(Data* d, Image* out) {
+  return (*out = ImageFlipUD(d->img)) != NULL;
+}
+
+static int RunCrop(Data* d, Image* out) {
+  int w = ImageWidth(d->img);
+  int h = ImageHeight(d->img);
+  return (*out = ImageCrop(d->img, w/4, h/4, w/2, h/2)) != NULL;
+}
+
+static int RunPaste(Data* d, Image* out) {
+  ImagePaste(d->work, ImageWidth(d->work)/4, ImageHeight(d->work)/4, d->half);
+  return 1;
+}
+
+static int RunBlend(Data* d, Image* out) {
+  ImageBlend(d->work, ImageWidth(d->work)/4, ImageHeight(d->work)/4, d->half, 0.5);
+  return 1;
+}
+
+static int RunLocate(Data* d, Image* out) {
+  int x, y;
+  return ImageLocateSubImage(d->img, &x, &y, d->tmpl);  // it must be found
+}
+
+static int RunBlur1(Data* d, Image* out) { return ImageBlur(d->work, 1, 1); }
+static int RunBlur3(Data* d, Image* out) { return ImageBlur(d->work, 3, 3); }
+static int RunBlur7(Data* d, Image* out) { return ImageBlur(d->work, 7, 7); }
+static int RunBlur15(Data* d, Image* out) { return ImageBlur(d->work, 15, 15); }
+static int RunBlurIntegral7(Data* d, Image* out) { return ImageBlurIntegral(d->work, 7, 7); }
+
+static const Op ops[] = {
+  {"load", 0, 0, RunLoad},
+  {"loadmapped", 0, 0, RunLoadMapped},
+  {"save", 0, 0, RunSave},
+  {"neg", 1, 0, RunNegative},
+  {"thr", 1, 0, RunThreshold},
+  {"bri", 1, 0, RunBrighten},
+  {"rotate", 0, 0, RunRotate},
+  {"rotate180", 0, 0, RunRotate180},
+  {"rotate270", 0, 0, RunRotate270},
+  {"mirror", 0, 0, RunMirror},
+  {"flip", 0, 0, RunFlip},
+  {"crop", 0, 1, RunCrop},
+  {"paste", 1, 1, RunPaste},
+  {"blend", 1, 1, RunBlend},
+  {"locate", 0, 0, RunLocate},
+  {"blur1", 1, 0, RunBlur1},
+  {"blur3", 1, 0, RunBlur3},
+  {"blur7", 1, 0, RunBlur7},
+  {"blur15", 1, 0, RunBlur15},
+  {"iblur7", 1, 0, RunBlurIntegral7},
+};
+#define NUMOPS ((int)(sizeof(ops) / sizeof(ops[0])))
+
+
+// A synthetic size x size image: a diagonal gradient with pseudo-random
+// noise, so that every region is distinct (for locate) but not flat.
+static Image Synthetic(int size) {
+  Image img = ImageCreate(size, size, PixMax);
+  if (img == NULL) return NULL;
+  unsigned int r = 2463534242u;  // xorshift32 state
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+      ImageSetPixel(img, x, y, (uint8)((x + y) / 2 + (r >> 27)));
+    }
+  }
+  return img;
+}
+
+// Set up the data for size x size images, with files in directory dir.
+// Returns 0 on failure.
+static int DataCreate(Data* d, int size, const char* dir) {
+  memset(d, 0, sizeof(*d));
+  d->img = Synthetic(size);
+  d->work = ImageCreate(size, size, PixMax);
+  d->half = Synthetic(size / 2);
+  d->tmpl = d->img != NULL ? ImageCrop(d->img, size - size/16 - 1, size - size/16 - 1, size/32, size/32) : NULL;
+  if (d->img == NULL || d->work == NULL || d->half == NULL || d->tmpl == NULL) return 0;
+  snprintf(d->file, sizeof(d->file), "%s/imageBench-%ld-in.pgm", dir, (long)getpid());
+  snprintf(d->out, sizeof(d->out), "%s/imageBench-%ld-out.pgm", dir, (long)getpid());
+  return ImageSave(d->img, d->file);
+}
+
+static void DataDestroy(Data* d) {
+  ImageDestroy(&d->img);
+  ImageDestroy(&d->work);
+  ImageDestroy(&d->half);
+  ImageDestroy(&d->tmpl);
+  if (d->file[0] != '\0') remove(d->file);
+  if (d->out[0] != '\0') remove(d->out);
+}
+
+
+// The result of one operation on one size.
+typedef struct {
+  const char* op;
+  int size;
+  int reps;
+  double mean, sd, min;   // times (seconds)
+  double mpix, mpixsd;    // throughput (megapixels per second)
+  double base;            // baseline throughput (0 if none)
+  int regression;         // is it slower than the baseline?
+} Result;
+
+// Time op on d, reps times, into res.  Returns 0 on failure.
+static int Measure(const Op* op, Data* d, int size, int reps, Result* res) {
+  double pixels = (double)size * size / (op->quarter ? 4 : 1);
+  double sum = 0.0, sum2 = 0.0, rsum = 0.0, rsum2 = 0.0;
+  res->op = op->name;
+  res->size = size;
+  res->reps = reps;
+  res->min = HUGE_VAL;
+  for (int i = 0; i < reps; i++) {
+    if (op->inplace) ImagePaste(d->work, 0, 0, d->img);
+    Image out = NULL;
+    double time = wall_time();
+    int ok = op->run(d, &out);
+    time = wall_time() - time;
+    if (out != NULL) ImageDestroy(&out);
+    if (!ok) return 0;
+    if (time <= 0.0) time = 1e-9;   // below clock resolution
+    double rate = pixels / time * 1e-6;
+    sum += time; sum2 += time*time;
+    rsum += rate; rsum2 += rate*rate;
+    if (time < res->min) res->min = time;
+  }
+  res->mean = sum / reps;
+  res->sd = sqrt(fmax(0.0, (sum2 - sum*sum/reps) / (reps - 1)));
+  res->mpix = rsum / reps;
+  res->mpixsd = sqrt(fmax(0.0, (rsum2 - rsum*rsum/reps) / (reps - 1)));
+  return 1;
+}
+
+
+// Read the throughput of op on size from baseline CSV file f.
+// Returns 0 if not found.
+static double Baseline(FILE* f, const char* op, int size) {
+  char line[256];
+  char name[64];
+  int w, h;
+  double mpix;
+  double found = 0.0;
+  rewind(f);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%63[^,],%d,%d,%*d,%*f,%*f,%*f,%lf", name, &w, &h, &mpix) == 4 &&
+        strcmp(name, op) == 0 && w == size && h == size)
+      found = mpix;
+  }
+  return found;
+}
+
+// Write results res[0..n-1] to file filename, in CSV or JSON.
+// Returns 0 on failure.
+static int Write(const char* filename, const Result* res, int n) {
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) return 0;
+  size_t len = strlen(filename);
+  int json = len >= 5 && strcmp(filename + len - 5, ".json") == 0;
+  if (json) fprintf(f, "[\n");
+  else fprintf(f, "op,width,height,reps,mean_s,sd_s,min_s,mpix_s,mpix_sd,threads\n");
+  for (int i = 0; i < n; i++) {
+    const Result* r = &res[i];
+    if (json) {
+      fprintf(f, "  {\"op\":\"%s\",\"width\":%d,\"height\":%d,\"reps\":%d,"
+              "\"mean_s\":%.9f,\"sd_s\":%.9f,\"min_s\":%.9f,"
+              "\"mpix_s\":%.3f,\"mpix_sd\":%.3f,\"threads\":%d",
+              r->op, r->size, r->size, r->reps, r->mean, r->sd, r->min,
+              r->mpix, r->mpixsd, ImageGetThreads());
+      if (r->base > 0.0)
+        fprintf(f, ",\"baseline_mpix_s\":%.3f,\"regression\":%s",
+                r->base, r->regression ? "true" : "false");
+      fprintf(f, "}%s\n", i+1 < n ? "," : "");
+    } else {
+      fprintf(f, "%s,%d,%d,%d,%.9f,%.9f,%.9f,%.3f,%.3f,%d\n",
+              r->op, r->size, r->size, r->reps, r->mean, r->sd, r->min,
+              r->mpix, r->mpixsd, ImageGetThreads());
+    }
+  }
+  if (json) fprintf(f, "]\n");
+  int ok = !ferror(f);
+  return fclose(f) == 0 && ok;
+}
+
+
+int main(int argc, char* argv[]) {
+  const char* sizes = "256,1024,4096";
+  int reps = 5;
+  int threads = 1;
+  const char* dir = getenv("TMPDIR");
+  const char* outfile = NULL;
+  const char* basefile = NULL;
+  double tolerance = 0.10;
+  if (dir == NULL || dir[0] == '\0') dir = "/tmp";
+
+  int c;
+  while ((c = getopt(argc, argv, "s:r:t:d:o:b:x:h")) != -1) {
+    switch (c) {
+    case 's': sizes = optarg; break;
+    case 'r': reps = atoi(optarg); break;
+    case 't': threads = atoi(optarg); break;
+    case 'd': dir = optarg; break;
+    case 'o': outfile = optarg; break;
+    case 'b': basefile = optarg; break;
+    case 'x': tolerance = atof(optarg); break;
+    default: error(1, 0, "\n%s", USAGE);
+    }
+  }
+  if (reps < 2) error(1, 0, "REPS must be at least 2");
+  for (int i = optind; i < argc; i++) {
+    int known = 0;
+    for (int o = 0; o < NUMOPS; o++) known |= strcmp(argv[i], ops[o].name) == 0;
+    if (!known) error(1, 0, "Unknown operation: %s", argv[i]);
+  }
+
+  FILE* base = NULL;
+  if (basefile != NULL) {
+    base = fopen(basefile, "r");
+    if (base == NULL) error(2, errno, "%s", basefile);
+  }
+
+  ImageInit();
+  ImageSetThreads(threads);
+
+  // Parse the sizes.
+  int size[32];
+  int nsizes = 0;
+  for (const char* s = sizes; *s != '\0' && nsizes < 32; ) {
+    char* end;
+    long v = strtol(s, &end, 10);
+    if (end == s || v < 32 || v > 65536) error(1, 0, "Invalid size in: %s", sizes);
+    size[nsizes++] = (int)v;
+    s = *end == ',' ? end + 1 : end;
+  }
+
+  Result* res = malloc(sizeof(Result) * NUMOPS * nsizes);
+  if (res == NULL) error(2, errno, "Allocating results");
+  int n = 0;
+  int regressions = 0;
+
+  printf("# %d threads, %d repetitions\n", ImageGetThreads(), reps);
+  printf("#%11s\t%11s\t%11s\t%11s\t%11s\t%11s", "op", "size", "mean_s", "sd_s", "mpix_s", "mpix_sd");
+  if (base != NULL) printf("\t%11s\t%11s", "baseline", "speedup");
+  puts("");
+  for (int s = 0; s < nsizes; s++) {
+    Data d;
+    if (!DataCreate(&d, size[s], dir)) {
+      error(2, errno, "Setting up %dx%d images: %s", size[s], size[s], ImageErrMsg());
+    }
+    for (int o = 0; o < NUMOPS; o++) {
+      int selected = optind == argc;
+      for (int i = optind; i < argc; i++) selected |= strcmp(argv[i], ops[o].name) == 0;
+      if (!selected) continue;
+      Result* r = &res[n++];
+      if (!Measure(&ops[o], &d, size[s], reps, r)) {
+        DataDestroy(&d);
+        error(2, errno, "%s on %dx%d: %s", ops[o].name, size[s], size[s], ImageErrMsg());
+      }
+      r->base = base != NULL ? Baseline(base, r->op, r->size) : 0.0;
+      r->regression = r->base > 0.0 && r->mpix < r->base * (1.0 - tolerance);
+      regressions += r->regression;
+      printf("%12s\t%11d\t%11.6f\t%11.6f\t%11.1f\t%11.1f", r->op, r->size,
+             r->mean, r->sd, r->mpix, r->mpixsd);
+      if (r->base > 0.0) {
+        printf("\t%11.1f\t%11.2f%s", r->base, r->mpix / r->base,
+               r->regression ? "\tREGRESSION" : "");
+      }
+      puts("");
+      fflush(stdout);
+    }
+    DataDestroy(&d);
+  }
+
+  if (base != NULL) {
+    fclose(base);
+    printf("# %d regressions (tolerance %.0f%%)\n", regressions, tolerance * 100);
+  }
+  if (outfile != NULL && !Write(outfile, res, n)) {
+    error(2, errno, "Writing %s", outfile);
+  }
+  free(res);
+  ImagePoolSetLimit(0);
+  return regressions > 0;
+}
@@ -15,8 +15,14 @@
 #include <errno.h>
 #include <error.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "image8bit.h"
+#include "image1bit.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
@@ -33,29 +39,80 @@ static const char* USAGE =
     "FILES:\n"
     "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
+    "  A command line of the form  batch J OUT INPUT OPERATION...  applies\n"
+    "  the OPERATIONs to each image in INPUT, with J images processed concurrently\n"
+    "  (0: one per CPU), and saves CURR to file OUT, where %s is replaced by\n"
+    "  the input name, without directory and extension.  INPUT is a directory\n"
+    "  (all its .pgm files) or a text file with one image file name per line.\n"
+    "  The image is I0 to start with.  The operations trace, threads, pool,\n"
+    "  tic, toc and perf (which set process-wide state) are not allowed.\n"
+    "  A command line of the form FILE OPS save FILE, where all OPS are neg, thr,\n"
+    "  bri, mirror, crop or blur, is run in strips, without loading the image.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
+    "  mmap FILE       Same as FILE, but map the file into memory instead of reading it\n"
     "  save FILE       Save CURR to PGM file\n"
+    "  pbm LEVEL FILE  Save CURR thresholded at LEVEL (as thr) to a 1-bit PBM file\n"
+    "  pbmload FILE    Load 1-bit PBM file, creating new image (white at maxval 255)\n"
     "  info            Show information on CURR (size and range)\n"
+    "  hist            Show the histogram of CURR, with mean and variance\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "                  (Times are calibrated once per run, unless the calibration\n"
+    "                  is given in $INSTR_CTU, or cached in file $INSTR_CTU_CACHE,\n"
+    "                  e.g. INSTR_CTU_CACHE=$HOME/.cache/instr-ctu.)\n"
+    "  perf            Also count hardware events (cycles, misses, ...) from now on,\n"
+    "                  and print them in toc, with cycles per pixel of CURR\n"
+    "  threads N       Use N threads in parallel operations (0: one per CPU)\n"
+    "  pool MB         Keep up to MB megabytes of freed image buffers for reuse\n"
+    "                  (default 256, 0 disables)\n"
+    "  trace FILE      Time every following operation, and write one event per\n"
+    "                  operation to FILE: in Chrome trace event format if FILE\n"
+    "                  ends in .json, or else in JSON Lines format\n"
+    "                  (The time of neg, thr and bri goes to the operation\n"
+    "                  that applies them.)\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "  (Consecutive neg, thr and bri are fused and applied in a single pass,\n"
+    "  when some other operation needs the pixels of the image.)\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  rotate180       Rotate CURR 180º, creating new image\n"
+    "  rotate270       Rotate CURR 270º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
+    "  flip            Flip CURR upside-down, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  view X,Y,W,H    Create a view of a rectangle of CURR, as a new image that\n"
+    "                  shares its pixels: operations on it change CURR in-place\n"
+    "  pop             Destroy CURR, so that PRED becomes CURR\n"
+    "  (Consecutive rotate..., mirror, flip and crop are composed, and their\n"
+    "  image is created in a single pass, when some operation needs its pixels.)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  locateall       Search PRED in CURR, print all matching positions\n"
+    "  plocate         Same as locate, with a coarse-to-fine pyramid search\n"
+    "  match TOL       Search PRED in CURR approximately, print the best position\n"
+    "                  if its mean absolute difference is <= TOL, or NOTFOUND\n"
+    "  matchall TOL    Print all positions of PRED in CURR within tolerance TOL\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  iblur DX,DY     Same as blur, but computed with an integral image\n"
+    "\n"              
+    "  band            Set CURR to the bitwise AND of PRED and CURR\n"
+    "  bor             Set CURR to the bitwise OR of PRED and CURR\n"
+    "  bxor            Set CURR to the bitwise XOR of PRED and CURR\n"
+    "  bnot            Set CURR to the bitwise NOT of CURR\n"
+    "  bcrop X,Y,W,H   Crop a rectangle from CURR, creating new image\n"
+    "  bpaste X,Y      Paste PRED into CURR at position (X,Y)\n"
+    "  (These operations take images as 1-bit bitmaps, white where pixels are\n"
+    "  nonzero, as after thr, and give white pixels at the maxval of CURR.)\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
@@ -74,8 +131,303 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Invalid batch input",
+  "Batch: some files failed",
+  "Image1bit failure: %s",
 };
 
+// Failure cause for error err, from the module that failed.
+static char* ErrMsg(int err) {
+  return err == 10 ? BitmapErrMsg() : ImageErrMsg();
+}
+
+// Capacity of the image buffer
+#define N 10
+
+// Print progress messages (on stderr)?
+static int verbose = 1;
+
+// Print a progress message, if verbose.
+static void Msg(const char* format, ...) {
+  if (!verbose) return;
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+
+// Lazy point operations.
+//
+// The point operations (neg, thr, bri) are pixel maps.  Instead of
+// sweeping over the image for each one, their maps are composed into a
+// pending map per image, which Flush applies in a single pass just before
+// some operation needs the actual pixels.  The result is the same.
+//
+// Lazy geometric operations.
+//
+// Likewise, the geometric operations (rotate..., mirror, flip, crop) do not
+// create their image right away.  It is recorded as a pending ImageXform of
+// the nearest actual image below it in the buffer, its base, and chains of
+// them are composed, so that Flush creates the image in a single pass, only
+// reading the pixels it needs.  The base cannot change meanwhile, because
+// only CURR is modified, and only after Flush.
+// (Point maps commute with geometric operations, so a pending map is
+// simply inherited.)
+typedef struct {
+  int pending;      // is there a pending map?
+  uint8 map[256];   // the pending map (when pending)
+  int base;         // index of the base image, or -1 if the image is actual
+  ImageXform xform; // the pending transformation of the base (when base>=0)
+} Lazy;
+
+// Start with nothing pending (for an actual image).
+static void LazyInit(Lazy* lz) {
+  lz->pending = 0;
+  lz->base = -1;
+}
+
+// Get the pending map of an image, starting with the identity if needed.
+static uint8* LazyMap(Lazy* lz) {
+  if (!lz->pending) {
+    ImageMapIdentity(lz->map);
+    lz->pending = 1;
+  }
+  return lz->map;
+}
+
+// Get the image from which the pixels of image k come: itself, if actual,
+// or its base.  (Either has the same maxval.)
+static Image Source(Image img[], Lazy lazy[], int k) {
+  return lazy[k].base >= 0 ? img[lazy[k].base] : img[k];
+}
+
+// Get the width and height of image k, even if not actual.
+static void Size(Image img[], Lazy lazy[], int k, int* w, int* h) {
+  if (lazy[k].base >= 0) {
+    *w = lazy[k].xform.width;
+    *h = lazy[k].xform.height;
+  } else {
+    *w = ImageWidth(img[k]);
+    *h = ImageHeight(img[k]);
+  }
+}
+
+// Make image k actual: create it, if it is pending, and apply its pending
+// map, if any.  Returns 0 on failure.
+static int Flush(Image img[], Lazy lazy[], int k) {
+  Lazy* lz = &lazy[k];
+  if (lz->base >= 0) {
+    img[k] = ImageXformApply(img[lz->base], &lz->xform);
+    if (img[k] == NULL) return 0;
+    lz->base = -1;
+  }
+  if (lz->pending) {
+    ImageApplyMap(img[k], lz->map);
+    lz->pending = 0;
+  }
+  return 1;
+}
+
+// Make image k a pending transformation of image k-1, initially the
+// identity, and return it, to be composed with some operation.
+// Returns NULL on failure.
+static ImageXform* Geometry(Image img[], Lazy lazy[], int k) {
+  img[k] = NULL;
+  if (lazy[k-1].base >= 0) {
+    lazy[k] = lazy[k-1];   // same base, transformation and map
+  } else {
+    if (!Flush(img, lazy, k-1)) return NULL;
+    LazyInit(&lazy[k]);
+    lazy[k].base = k-1;
+    ImageXformInit(&lazy[k].xform, img[k-1]);
+  }
+  return &lazy[k].xform;
+}
+
+// Bitmap operations.
+//
+// The operations band, bor, bxor, bnot, bcrop and bpaste take images as
+// bitmaps, white where their pixels are nonzero (as after thr), and
+// compute with image1bit.  Their results have white pixels at the maxval
+// of CURR.
+
+// Replace the pixels of actual image img with those of bitmap bm, of the
+// same size.  Returns 0 on failure (of image8bit).
+static int StoreBitmap(Image img, Bitmap bm) {
+  Image bits = BitmapToImage(bm, (uint8)ImageMaxval(img));
+  if (bits == NULL) return 0;
+  ImagePaste(img, 0, 0, bits);
+  ImageDestroy(&bits);
+  return 1;
+}
+
+
+// Tracing.
+//
+// When tracing, each operation is timed (wall-clock and cpu time) and
+// counted, and written to the trace file as an event, along with the
+// index and size of CURR after the operation.
+typedef struct {
+  FILE* f;            // the trace file (NULL if not tracing)
+  int chrome;         // in Chrome trace event format? (or JSON Lines)
+  int events;         // number of events written
+  double start;       // wall time when tracing started
+  double wall, cpu;   // times at the start of the operation
+  unsigned long count[NUMCOUNTERS];  // counters at the start of the operation
+} Trace;
+
+// Write string str to f, quoted and escaped as a JSON string.
+static void JsonString(FILE* f, const char* str) {
+  fputc('"', f);
+  for (const unsigned char* c = (const unsigned char*)str; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') fprintf(f, "\\%c", *c);
+    else if (*c < 0x20) fprintf(f, "\\u%04x", *c);
+    else fputc(*c, f);
+  }
+  fputc('"', f);
+}
+
+// Start tracing to file filename.  Returns 0 on failure (with errno set).
+static int TraceOpen(Trace* tr, const char* filename) {
+  tr->f = fopen(filename, "w");
+  if (tr->f == NULL) return 0;
+  size_t len = strlen(filename);
+  tr->chrome = len >= 5 && strcmp(filename + len - 5, ".json") == 0;
+  if (tr->chrome) fputs("[\n", tr->f);
+  tr->events = 0;
+  tr->start = wall_time();
+  return 1;
+}
+
+// Mark the start of an operation.
+static void TraceBegin(Trace* tr) {
+  InstrTotal(tr->count);
+  tr->cpu = cpu_time();
+  tr->wall = wall_time();
+}
+
+// Write the event of the operation started by TraceBegin.
+// op is its name, arg its operand (or NULL), and the current image has
+// index i (-1 if none) and size w x h.
+static void TraceEnd(Trace* tr, const char* op, const char* arg, int i, int w, int h) {
+  double wall = wall_time() - tr->wall;
+  double cpu = cpu_time() - tr->cpu;
+  unsigned long count[NUMCOUNTERS];
+  InstrTotal(count);
+  double mpix = wall > 0.0 ? (double)w*h / wall * 1e-6 : 0.0;
+  FILE* f = tr->f;
+  if (tr->chrome) {
+    fprintf(f, "%s{\"name\":", tr->events > 0 ? ",\n" : "");
+    JsonString(f, op);
+    fprintf(f, ",\"cat\":\"imageTool\",\"ph\":\"X\",\"pid\":1,\"tid\":1"
+            ",\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+            (tr->wall - tr->start) * 1e6, wall * 1e6);
+  } else {
+    fputs("{\"op\":", f);
+    JsonString(f, op);
+    fprintf(f, ",\"start\":%.9f,", tr->wall - tr->start);
+  }
+  fputs("\"arg\":", f);
+  if (arg != NULL) JsonString(f, arg); else fputs("null", f);
+  fprintf(f, ",\"image\":%d,\"width\":%d,\"height\":%d", i, w, h);
+  fprintf(f, ",\"wall\":%.9f,\"cpu\":%.9f,\"mpix_per_s\":%.3f", wall, cpu, mpix);
+  for (int c = 0; c < NUMCOUNTERS; c++) {
+    if (InstrName[c] == NULL) continue;
+    fputc(',', f);
+    JsonString(f, InstrName[c]);
+    // (tic may reset the counters during the operation)
+    fprintf(f, ":%lu", count[c] >= tr->count[c] ? count[c] - tr->count[c] : count[c]);
+  }
+  fputs(tr->chrome ? "}}" : "}\n", f);
+  tr->events++;
+}
+
+// Stop tracing.  Returns 0 if the file could not be written.
+static int TraceClose(Trace* tr) {
+  if (tr->f == NULL) return 1;
+  if (tr->chrome) fputs("\n]\n", tr->f);
+  int ok = !ferror(tr->f);
+  ok = fclose(tr->f) == 0 && ok;
+  tr->f = NULL;
+  return ok;
+}
+
+
+// Streaming.
+//
+// A command line of the form
+//   FILE (neg | thr LEVEL | bri FACTOR | mirror | crop X,Y,W,H | blur DX,DY)* save FILE
+// only needs a few rows of the image at a time, so it is run as a strip
+// pipeline, which never loads the whole image.  The result is the same.
+//
+// Returns the error code, or -1 if the command line is not of that form,
+// or some operand is invalid, or the pipeline cannot be set up.
+// (Then, the command line should be processed as usual, which reports
+// any errors.)
+static int Stream(int ac, char* av[]) {
+  if (ac < 4 || strcmp(av[ac-2], "save") != 0) return -1;
+  // The output is written while the input is read: never overwrite it.
+  struct stat in, out;
+  int errnum = errno;
+  if (stat(av[1], &in) != 0) return -1;
+  if (stat(av[ac-1], &out) == 0 && in.st_dev == out.st_dev && in.st_ino == out.st_ino) return -1;
+  errno = errnum;  // (a missing output is fine)
+  // Check the operation names, before opening the file.
+  for (int k = 2; k < ac-2; k++) {
+    if (strcmp(av[k], "neg") == 0 || strcmp(av[k], "mirror") == 0) continue;
+    if (strcmp(av[k], "thr") != 0 && strcmp(av[k], "bri") != 0 &&
+        strcmp(av[k], "crop") != 0 && strcmp(av[k], "blur") != 0) return -1;
+    if (++k >= ac-2) return -1;  // missing operand
+  }
+  Pipeline p = PipelineOpen(av[1]);
+  if (p == NULL) return -1;
+  int ok = 1;
+  for (int k = 2; ok && k < ac-2; k++) {
+    if (strcmp(av[k], "neg") == 0) {
+      ok = PipelineNegative(p);
+    } else if (strcmp(av[k], "mirror") == 0) {
+      ok = PipelineMirror(p);
+    } else if (strcmp(av[k], "thr") == 0) {
+      uint8 thr;
+      ok = sscanf(av[++k], "%hhu", &thr) == 1 && PipelineThreshold(p, thr);
+    } else if (strcmp(av[k], "bri") == 0) {
+      double factor;
+      ok = sscanf(av[++k], "%lf", &factor) == 1 && PipelineBrighten(p, factor);
+    } else if (strcmp(av[k], "crop") == 0) {
+      int x, y, w, h;
+      ok = sscanf(av[++k], "%d,%d,%d,%d", &x, &y, &w, &h) == 4 &&
+           PipelineValidRect(p, x, y, w, h) && PipelineCrop(p, x, y, w, h);
+    } else if (strcmp(av[k], "blur") == 0) {
+      int dx, dy;
+      ok = sscanf(av[++k], "%d,%d", &dx, &dy) == 2 && dx >= 0 && dy >= 0 &&
+           PipelineBlur(p, dx, dy);
+    }
+  }
+  if (!ok) {
+    PipelineDestroy(&p);
+    return -1;
+  }
+  Msg("Streaming %s -> %s in strips (%dx%d)\n", av[1], av[ac-1],
+      PipelineWidth(p), PipelineHeight(p));
+  // Write to a temporary file, renamed to the output only on success,
+  // so that a failure leaves no partial output.
+  char tmp[4096];
+  int err = 4;
+  if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", av[ac-1], (long)getpid()) < (int)sizeof(tmp)) {
+    err = PipelineRun(p, tmp, 0) && rename(tmp, av[ac-1]) == 0 ? 0 : 4;
+    if (err != 0) {
+      errnum = errno;
+      unlink(tmp);
+      errno = errnum;
+    }
+  } else {
+    errno = ENAMETOOLONG;
+  }
+  PipelineDestroy(&p);
+  return err;
+}
+
 
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
@@ -85,26 +437,38 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// Number of operands that Run takes after operation name: 0 for image
+// files and operations without operands.  (Keep in sync with Run.)
+static int Operands(const char* name) {
+  static const char* one[] = {
+    "trace", "threads", "pool", "thr", "bri", "create", "crop", "view",
+    "paste", "blend", "match", "matchall", "blur", "iblur", "save", "mmap",
+    "pbmload", "bcrop", "bpaste",
+  };
+  if (strcmp(name, "pbm") == 0) return 2;
+  for (size_t i = 0; i < sizeof(one)/sizeof(one[0]); i++) {
+    if (strcmp(name, one[i]) == 0) return 1;
   }
+  return 0;
+}
 
-  ImageInit();
-
+// Process the operations in av[k..ac-1] over the image buffer
+// img[0..*pn-1], with pending point operations lazy[0..*pn-1].
+// Images created are appended to the buffer, and *pn is updated.
+// Returns the error code (0 on success).
+static int Run(int ac, char* av[], int k, Image img[], Lazy lazy[], int* pn, Trace* tr) {
   int err = 0;
+  int n = *pn;
   int x, y, w, h;
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
-
-  int k = 1;
   while (k < ac) {
+    int op = k;               // the operation (its operand, if any, is av[k])
+    const char* name = av[k]; // its name in the trace
+    if (tr->f != NULL) TraceBegin(tr);
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
+      Msg("Info on I%d\n", n-1);
+      if (!Flush(img, lazy, n-1)) { err = 4; break; }
       uint8 min, max;
       w = ImageWidth(img[n-1]);
       h = ImageHeight(img[n-1]);
@@ -112,116 +476,621 @@ int main(int ac, char* av[]) {
       ImageStats(img[n-1], &min, &max);
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
       printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+    } else if (strcmp(av[k], "hist") == 0) {
+      if (n < 1) { err = 2; break; }
+      Msg("Histogram of I%d\n", n-1);
+      if (!Flush(img, lazy, n-1)) { err = 4; break; }
+      ImageHist hist;
+      ImageHistogram(img[n-1], &hist);
+      printf("# Pixels: %" PRIu64 "\n", hist.pixels);
+      printf("# Gray level range: [%hhu, %hhu]\n", hist.min, hist.max);
+      printf("# Mean: %.3f\n# Variance: %.3f\n", hist.mean, hist.variance);
+      for (int i = 0; i < 256; i++) {
+        if (hist.count[i] > 0) printf("%3d %" PRIu64 "\n", i, hist.count[i]);
+      }
     } else if (strcmp(av[k], "tic") == 0) {
+      // Apply pending (point and geometric) operations now, so they are
+      // not measured.
+      if (n > 0 && !Flush(img, lazy, n-1)) { err = 4; break; }
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
+      // Apply pending operations now, so they are measured.
+      if (n > 0 && !Flush(img, lazy, n-1)) { err = 4; break; }
+      w = n > 0 ? ImageWidth(img[n-1]) : 0;
+      h = n > 0 ? ImageHeight(img[n-1]) : 0;
+      InstrPixels = (unsigned long)w*h;
       InstrPrint();
+    } else if (strcmp(av[k], "perf") == 0) {
+      int nhw = InstrHWEnable();
+      Msg("Using %d hardware counters\n", nhw);
+      if (nhw == 0) Msg("(perf_event_open: %s)\n", strerror(errno));
+      errno = 0;  // missing counters are not an error for this program
+    } else if (strcmp(av[k], "trace") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (!TraceClose(tr)) { err = 5; break; }
+      if (!TraceOpen(tr, av[k])) { err = 5; break; }
+      Msg("Tracing to %s\n", av[k]);
+      k++;
+      continue;   // not an operation to trace
+    } else if (strcmp(av[k], "threads") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int nt;
+      if (sscanf(av[k], "%d", &nt) != 1) { err = 5; break; }
+      ImageSetThreads(nt);
+      Msg("Using %d threads\n", ImageGetThreads());
+    } else if (strcmp(av[k], "pool") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int mb;
+      if (sscanf(av[k], "%d", &mb) != 1 || mb < 0) { err = 5; break; }
+      ImagePoolSetLimit((size_t)mb << 20);
+      Msg("Using a pool of %d MB\n", mb);
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      Msg("Negating I%d\n", n-1);
+      ImageMapNegative(Source(img, lazy, n-1), LazyMap(&lazy[n-1]));
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      Msg("Thresholding I%d at %d\n", n-1, thr);
+      ImageMapThreshold(Source(img, lazy, n-1), LazyMap(&lazy[n-1]), (uint8)thr);
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      Msg("Brightening I%d by %lf\n", n-1, factor);
+      ImageMapBrighten(Source(img, lazy, n-1), LazyMap(&lazy[n-1]), factor);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
+      Msg("Creating black image (%d,%d) -> I%d\n", w, h, n);
       img[n] = ImageCreate(w, h, PixMax);
       if (img[n] == NULL) { err = 4; break; }
+      LazyInit(&lazy[n]);
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
+      Msg("Rotating I%d -> I%d\n", n-1, n);
+      ImageXform* t = Geometry(img, lazy, n);
+      if (t == NULL) { err = 4; break; }
+      ImageXformRotate(t);
+      n++;
+    } else if (strcmp(av[k], "rotate180") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      Msg("Rotating I%d by 180º -> I%d\n", n-1, n);
+      ImageXform* t = Geometry(img, lazy, n);
+      if (t == NULL) { err = 4; break; }
+      ImageXformRotate180(t);
+      n++;
+    } else if (strcmp(av[k], "rotate270") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      Msg("Rotating I%d by 270º -> I%d\n", n-1, n);
+      ImageXform* t = Geometry(img, lazy, n);
+      if (t == NULL) { err = 4; break; }
+      ImageXformRotate270(t);
       n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
+      Msg("Mirroring I%d -> I%d\n", n-1, n);
+      ImageXform* t = Geometry(img, lazy, n);
+      if (t == NULL) { err = 4; break; }
+      ImageXformMirror(t);
+      n++;
+    } else if (strcmp(av[k], "flip") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      Msg("Flipping I%d -> I%d\n", n-1, n);
+      ImageXform* t = Geometry(img, lazy, n);
+      if (t == NULL) { err = 4; break; }
+      ImageXformFlipUD(t);
       n++;
     } else if (strcmp(av[k], "crop") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      ImageXform* t = Geometry(img, lazy, n);
+      if (t == NULL) { err = 4; break; }
+      if (!ImageXformValidRect(t, x, y, w, h)) { err = 5; break; }   // precondition check!
+      Msg("Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      ImageXformCrop(t, x, y, w, h);
+      n++;
+    } else if (strcmp(av[k], "view") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (!Flush(img, lazy, n-1)) { err = 4; break; }
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
+      Msg("Viewing I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      img[n] = ImageCreateView(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
+      LazyInit(&lazy[n]);
       n++;
+    } else if (strcmp(av[k], "pop") == 0) {
+      if (n < 1) { err = 2; break; }
+      Msg("Destroying I%d\n", n-1);
+      if (lazy[n-1].base < 0) Flush(img, lazy, n-1);  // it may be a view
+      ImageDestroy(&img[--n]);
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
       if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+      if (!Flush(img, lazy, n-2) || !Flush(img, lazy, n-1)) { err = 4; break; }
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+      Msg("Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
       ImagePaste(img[n-1], x, y, img[n-2]);
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
       double alpha;
       if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
+      if (!Flush(img, lazy, n-2) || !Flush(img, lazy, n-1)) { err = 4; break; }
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
+      Msg("Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
       ImageBlend(img[n-1], x, y, img[n-2], alpha);
-    } else if (strcmp(av[k], "locate") == 0) {
+    } else if (strcmp(av[k], "locate") == 0 || strcmp(av[k], "plocate") == 0) {
       if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
+      int pyramid = av[k][0] == 'p';
+      Msg("Locating I%d in I%d%s\n", n-2, n-1, pyramid ? " (pyramid)" : "");
+      if (!Flush(img, lazy, n-2) || !Flush(img, lazy, n-1)) { err = 4; break; }
+      if ((pyramid ? ImageLocateSubImagePyramid : ImageLocateSubImage)(img[n-1], &x, &y, img[n-2])) {
         printf("# FOUND (%d,%d)\n", x, y);
       } else {
         printf("# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "locateall") == 0) {
+      if (n < 2) { err = 2; break; }
+      Msg("Locating all I%d in I%d\n", n-2, n-1);
+      if (!Flush(img, lazy, n-2) || !Flush(img, lazy, n-1)) { err = 4; break; }
+      ImagePos* pos;
+      int count = ImageLocateAll(img[n-1], img[n-2], 0, &pos);
+      if (count < 0) { err = 4; break; }
+      for (int i = 0; i < count; i++) {
+        printf("# FOUND (%d,%d)\n", pos[i].x, pos[i].y);
+      }
+      printf("# %d MATCHES\n", count);
+      free(pos);
+    } else if (strcmp(av[k], "match") == 0 || strcmp(av[k], "matchall") == 0) {
+      int all = av[k][5] == 'a';
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      double tol;
+      if (sscanf(av[k], "%lf", &tol) != 1 || !(tol >= 0.0)) { err = 5; break; }
+      Msg("Matching %sI%d in I%d with tolerance %g\n", all ? "all " : "", n-2, n-1, tol);
+      if (!Flush(img, lazy, n-2) || !Flush(img, lazy, n-1)) { err = 4; break; }
+      // tol is the mean absolute difference per pixel
+      uint64_t maxsad = (uint64_t)(tol * ImageWidth(img[n-2]) * ImageHeight(img[n-2]));
+      if (all) {
+        ImagePos* pos;
+        int count = ImageLocateAllApprox(img[n-1], img[n-2], maxsad, &pos);
+        if (count < 0) { err = 4; break; }
+        for (int i = 0; i < count; i++) {
+          printf("# FOUND (%d,%d)\n", pos[i].x, pos[i].y);
+        }
+        printf("# %d MATCHES\n", count);
+        free(pos);
+      } else {
+        uint64_t sad;
+        int found = ImageLocateSubImageApprox(img[n-1], &x, &y, img[n-2], &sad);
+        if (found < 0) { err = 4; break; }
+        if (found && sad <= maxsad) {
+          printf("# FOUND (%d,%d) SAD %" PRIu64 "\n", x, y, sad);
+        } else {
+          printf("# NOTFOUND\n");
+        }
+      }
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      Msg("Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
+      if (!Flush(img, lazy, n-1)) { err = 4; break; }
+      if (ImageBlur(img[n-1], dx, dy) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "iblur") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      Msg("Blur I%d with %dx%d mean filter (integral image)\n", n-1, 2*dx+1, 2*dy+1);
+      if (!Flush(img, lazy, n-1)) { err = 4; break; }
+      if (ImageBlurIntegral(img[n-1], dx, dy) == 0) { err = 4; break; }
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
+      Msg("Saving %s <- I%d\n", av[k], n-1);
+      if (!Flush(img, lazy, n-1)) { err = 4; break; }
       if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "pbm") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int level;
+      if (sscanf(av[k], "%d", &level) != 1 || level < 0 || level > PixMax) { err = 5; break; }
+      if (++k >= ac) { err = 1; break; }
+      Msg("Saving %s <- I%d thresholded at %d (PBM)\n", av[k], n-1, level);
+      if (!Flush(img, lazy, n-1)) { err = 4; break; }
+      Bitmap bm = BitmapFromImage(img[n-1], (uint8)level);
+      if (bm == NULL) { err = 10; break; }
+      Msg("%" PRIu64 " white pixels\n", BitmapArea(bm));
+      int ok = BitmapSave(bm, av[k]);
+      BitmapDestroy(&bm);
+      if (!ok) { err = 10; break; }
+    } else if (strcmp(av[k], "pbmload") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      Msg("Loading %s (PBM) -> I%d\n", av[k], n);
+      Bitmap bm = BitmapLoad(av[k]);
+      if (bm == NULL) { err = 10; break; }
+      img[n] = BitmapToImage(bm, PixMax);
+      BitmapDestroy(&bm);
+      if (img[n] == NULL) { err = 4; break; }
+      LazyInit(&lazy[n]);
+      n++;
+    } else if (strcmp(av[k], "band") == 0 || strcmp(av[k], "bor") == 0 ||
+               strcmp(av[k], "bxor") == 0) {
+      if (n < 2) { err = 2; break; }
+      int which = av[k][1] == 'a' ? 0 : av[k][1] == 'o' ? 1 : 2;
+      static const char* names[] = { "AND", "OR", "XOR" };
+      static void (*const combine[])(Bitmap, Bitmap) = { BitmapAnd, BitmapOr, BitmapXor };
+      Msg("Combining I%d into I%d with bitwise %s\n", n-2, n-1, names[which]);
+      if (!Flush(img, lazy, n-2) || !Flush(img, lazy, n-1)) { err = 4; break; }
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      if (w != ImageWidth(img[n-1]) || h != ImageHeight(img[n-1])) { err = 6; break; }
+      Bitmap bm1 = BitmapFromImage(img[n-1], 1);
+      Bitmap bm2 = BitmapFromImage(img[n-2], 1);
+      if (bm1 != NULL && bm2 != NULL) {
+        combine[which](bm1, bm2);
+        err = StoreBitmap(img[n-1], bm1) ? 0 : 4;
+      } else {
+        err = 10;
+      }
+      BitmapDestroy(&bm1);
+      BitmapDestroy(&bm2);
+      if (err != 0) break;
+    } else if (strcmp(av[k], "bnot") == 0) {
+      if (n < 1) { err = 2; break; }
+      Msg("Inverting I%d with bitwise NOT\n", n-1);
+      if (!Flush(img, lazy, n-1)) { err = 4; break; }
+      Bitmap bm = BitmapFromImage(img[n-1], 1);
+      if (bm == NULL) { err = 10; break; }
+      BitmapNot(bm);
+      err = StoreBitmap(img[n-1], bm) ? 0 : 4;
+      BitmapDestroy(&bm);
+      if (err != 0) break;
+    } else if (strcmp(av[k], "bcrop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (!Flush(img, lazy, n-1)) { err = 4; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      Msg("Cropping bitmap of I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      Bitmap bm = BitmapFromImage(img[n-1], 1);
+      Bitmap crop = bm != NULL ? BitmapCrop(bm, x, y, w, h) : NULL;
+      BitmapDestroy(&bm);
+      if (crop == NULL) { err = 10; break; }
+      img[n] = BitmapToImage(crop, (uint8)ImageMaxval(img[n-1]));
+      BitmapDestroy(&crop);
+      if (img[n] == NULL) { err = 4; break; }
+      LazyInit(&lazy[n]);
+      n++;
+    } else if (strcmp(av[k], "bpaste") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+      if (!Flush(img, lazy, n-2) || !Flush(img, lazy, n-1)) { err = 4; break; }
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      Msg("Pasting bitmap of I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+      Bitmap bm1 = BitmapFromImage(img[n-1], 1);
+      Bitmap bm2 = BitmapFromImage(img[n-2], 1);
+      if (bm1 != NULL && bm2 != NULL) {
+        BitmapPaste(bm1, x, y, bm2);
+        err = StoreBitmap(img[n-1], bm1) ? 0 : 4;
+      } else {
+        err = 10;
+      }
+      BitmapDestroy(&bm1);
+      BitmapDestroy(&bm2);
+      if (err != 0) break;
+    } else if (strcmp(av[k], "mmap") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      Msg("Mapping %s -> I%d\n", av[k], n);
+      img[n] = ImageLoadMapped(av[k]);
+      if (img[n] == NULL) { err = 4; break; }
+      LazyInit(&lazy[n]);
+      n++;
     } else {  // image file
+      name = "load";
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
+      Msg("Loading %s -> I%d\n", av[k], n);
       img[n] = ImageLoad(av[k]);
       if (img[n] == NULL) { err = 4; break; }
+      LazyInit(&lazy[n]);
       n++;
     }
+    if (tr->f != NULL) {
+      const char* arg = k > op || name != av[op] ? av[k] : NULL;
+      w = h = 0;
+      if (n > 0) Size(img, lazy, n-1, &w, &h);
+      TraceEnd(tr, name, arg, n-1, w, h);
+    }
     k++;
   }
+  *pn = n;
+  return err;
+}
+
+
+// Batch mode.
+//
+// The command line
+//   batch J OUT INPUT OPERATION...
+// runs OPERATION... on each input image (as I0), and saves CURR to the
+// file named by template OUT.  J worker threads take the next input, until
+// there are none left.  Progress messages of the operations are turned off,
+// and operations on process-wide state (trace, threads, ...) are rejected.
+typedef struct {
+  int ac;                   // the command line (operations start at av[5])
+  char** av;
+  const char* out;          // template of output file names
+  char** input;             // input file names
+  int ninputs;
+  pthread_mutex_t lock;     // protects the following:
+  int next;                 // index of next input to process
+  int failed;               // number of inputs that failed
+  double pixels;            // pixels loaded
+} BatchJob;
+
+static int CompareNames(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Read the input file names of a batch: all .pgm files in directory
+// name, or the lines of file name.  Returns 0 on failure, including
+// names that are too long or cannot be stored: a batch never runs on
+// part of its input.
+static int BatchInputs(BatchJob* b, const char* name) {
+  struct stat st;
+  if (stat(name, &st) != 0) return 0;
+  int cap = 64;
+  b->input = malloc(cap * sizeof(char*));
+  b->ninputs = 0;
+  if (b->input == NULL) return 0;
+  char path[4096];
+  DIR* dir = NULL;
+  FILE* list = NULL;
+  if (S_ISDIR(st.st_mode)) dir = opendir(name); else list = fopen(name, "r");
+  if (dir == NULL && list == NULL) return 0;
+  int ok = 1;
+  while (ok) {
+    if (dir != NULL) {
+      errno = 0;
+      struct dirent* e = readdir(dir);
+      if (e == NULL) { ok = errno == 0; break; }
+      size_t len = strlen(e->d_name);
+      if (len < 5 || strcmp(e->d_name + len - 4, ".pgm") != 0) continue;
+      if (snprintf(path, sizeof(path), "%s/%s", name, e->d_name) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        ok = 0;
+        break;
+      }
+    } else {
+      if (fgets(path, sizeof(path), list) == NULL) { ok = !ferror(list); break; }
+      size_t len = strlen(path);
+      if (len == sizeof(path)-1 && path[len-1] != '\n') {
+        // A full buffer must end the line (or the file), or else the
+        // name does not fit.
+        int c = getc(list);
+        if (c != '\n' && c != EOF) {
+          errno = ENAMETOOLONG;
+          ok = 0;
+          break;
+        }
+      }
+      path[strcspn(path, "\r\n")] = '\0';
+      if (path[0] == '\0') continue;
+    }
+    if (b->ninputs == cap) {
+      char** more = realloc(b->input, 2 * cap * sizeof(char*));
+      ok = more != NULL;
+      if (!ok) break;
+      b->input = more;
+      cap *= 2;
+    }
+    ok = (b->input[b->ninputs] = strdup(path)) != NULL;
+    if (ok) b->ninputs++;
+  }
+  int errnum = errno;
+  if (dir != NULL) {
+    closedir(dir);
+    qsort(b->input, b->ninputs, sizeof(char*), CompareNames);
+  } else {
+    fclose(list);
+  }
+  errno = errnum;
+  return ok;
+}
+
+// Make the output file name for input file name, from template out.
+// Returns 0 if it is too long.
+static int BatchOutput(char* buf, size_t size, const char* out, const char* input) {
+  const char* base = strrchr(input, '/');
+  base = base != NULL ? base + 1 : input;
+  const char* dot = strrchr(base, '.');
+  int baselen = dot != NULL && dot != base ? (int)(dot - base) : (int)strlen(base);
+  size_t len = 0;
+  for (const char* c = out; *c != '\0' && len < size; c++) {
+    if (c[0] == '%' && c[1] == 's') {
+      len += snprintf(buf + len, size - len, "%.*s", baselen, base);
+      c++;
+    } else {
+      buf[len++] = *c;
+    }
+  }
+  if (len >= size) return 0;
+  buf[len] = '\0';
+  return 1;
+}
+
+// Process input i of batch b.  Returns the error code (0 on success).
+static int BatchOne(BatchJob* b, int i, double* pixels) {
+  char out[4096];
+  if (!BatchOutput(out, sizeof(out), b->out, b->input[i])) {
+    errno = ENAMETOOLONG;
+    return 5;
+  }
+  Image img[N];
+  Lazy lazy[N];
+  int n = 0;
+  int err = 0;
+  img[0] = ImageLoad(b->input[i]);
+  if (img[0] == NULL) return 4;
+  LazyInit(&lazy[0]);
+  n = 1;
+  *pixels = (double)ImageWidth(img[0]) * ImageHeight(img[0]);
+  Trace trace = { .f = NULL };
+  err = Run(b->ac, b->av, 5, img, lazy, &n, &trace);
+  if (err == 0 && n < 1) err = 2;
+  if (err == 0) {
+    if (!Flush(img, lazy, n-1) || ImageSave(img[n-1], out) == 0) err = 4;
+  }
+  int errsave = errno;
+  while (n > 0) {
+    ImageDestroy(&img[--n]);
+  }
+  errno = errsave;
+  if (err == 0) fprintf(stderr, "%s -> %s\n", b->input[i], out);
+  return err;
+}
+
+// Worker thread: process inputs until there are none left.
+static void* BatchWorker(void* arg) {
+  BatchJob* b = (BatchJob*)arg;
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    int i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->ninputs) break;
+    double pixels = 0.0;
+    int err = BatchOne(b, i, &pixels);
+    if (err != 0) {
+      char msg[256];
+      snprintf(msg, sizeof(msg), errors[err], ErrMsg(err));
+      error(0, errno, "%s: %s", b->input[i], msg);
+    }
+    pthread_mutex_lock(&b->lock);
+    b->failed += err != 0;
+    b->pixels += pixels;
+    pthread_mutex_unlock(&b->lock);
+  }
+  return NULL;
+}
+
+// Run the batch command line.  Returns the error code.
+static int Batch(int ac, char* av[]) {
+  if (ac < 5) return 1;
+  int nworkers;
+  if (sscanf(av[2], "%d", &nworkers) != 1 || nworkers < 0) return 5;
+  if (nworkers == 0) nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nworkers < 1) nworkers = 1;
+  if (strstr(av[3], "%s") == NULL) return 5;   // outputs would collide
+  // Operations that set process-wide state would race between workers.
+  // (Only operation names count: their operands may be anything.)
+  static const char* global[] = { "trace", "threads", "pool", "tic", "toc", "perf" };
+  for (int k = 5; k < ac; k += 1 + Operands(av[k])) {
+    for (size_t g = 0; g < sizeof(global)/sizeof(global[0]); g++) {
+      if (strcmp(av[k], global[g]) == 0) return 5;
+    }
+  }
+
+  BatchJob b = { .ac = ac, .av = av, .out = av[3], .lock = PTHREAD_MUTEX_INITIALIZER };
+  errno = 0;
+  int err = 0;
+  if (!BatchInputs(&b, av[4])) {
+    err = 8;
+  } else if (b.ninputs == 0) {
+    fprintf(stderr, "Batch of 0 files: nothing to do\n");
+  } else {
+    if (nworkers > b.ninputs) nworkers = b.ninputs;
+    fprintf(stderr, "Batch of %d files with %d workers\n", b.ninputs, nworkers);
+    verbose = 0;
+    double time = wall_time();
+    pthread_t tid[nworkers];
+    int started = 0;
+    while (started < nworkers &&
+           pthread_create(&tid[started], NULL, BatchWorker, &b) == 0) {
+      started++;
+    }
+    if (started == 0) BatchWorker(&b);  // no threads: do it all here
+    for (int t = 0; t < started; t++) {
+      pthread_join(tid[t], NULL);
+    }
+    time = wall_time() - time;
+    verbose = 1;
+    fprintf(stderr, "Batch done: %d files, %d failed, %.3f s: %.1f files/s, %.1f MPix/s\n",
+            b.ninputs, b.failed, time, time > 0.0 ? b.ninputs / time : 0.0,
+            time > 0.0 ? b.pixels / time * 1e-6 : 0.0);
+    if (b.failed > 0) { err = 9; errno = 0; }
+  }
+  for (int i = 0; i < b.ninputs; i++) {
+    free(b.input[i]);
+  }
+  free(b.input);
+  return err;
+}
+
+
+int main(int ac, char* av[]) {
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+  ImagePoolSetLimit((size_t)256 << 20);
+
+  int err = strcmp(av[1], "batch") == 0 ? Batch(ac, av) : Stream(ac, av);
+  if (err >= 0) {
+    error(err, errno, errors[err], ErrMsg(err));
+    return 0;
+  }
+
+  // The image buffer
+  Image img[N];       // the images
+  Lazy lazy[N];       // their pending point operations
+  int n = 0;          // number of images created
+
+  Trace trace = { .f = NULL };
+
+  err = Run(ac, av, 1, img, lazy, &n, &trace);
+  if (!TraceClose(&trace) && err == 0) err = 5;
   
   // Destroy remaining images
   while (n > 0) {
     ImageDestroy(&img[--n]);
   }
 
-  error(err, errno, errors[err], ImageErrMsg());
+  ImagePoolSetLimit(0);  // release pooled buffers
+
+  error(err, errno, errors[err], ErrMsg(err));
   return 0;
 }
 
@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Call once, to measure CTU (or InstrCalibrateLazy())
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -22,10 +22,23 @@
 #include "instrumentation.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef INSTR_SHARDED
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock (monotonic) time in seconds
+double wall_time(void) ; ///
+
 #if defined(__linux__) || defined(__APPLE__)
 
 //
@@ -42,6 +55,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,6 +87,11 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+// The performance counter is already a wall clock.
+double wall_time(void) {
+  return cpu_time();
+}
+
 #endif
 
 /// Array of operation counters:
@@ -76,54 +102,349 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
     // All elements initialized to NULL
     // See: https://en.cppreference.com/w/c/language/array_initialization
 
+#ifdef INSTR_SHARDED
+
+/// The shard of the running thread.
+__thread InstrShard InstrMyShard;  ///extern
+
+// Shards in use, and the counts of shards no longer in use (of finished
+// threads), protected by a lock.
+static pthread_mutex_t shardLock = PTHREAD_MUTEX_INITIALIZER;
+static InstrShard* shards = NULL;
+static unsigned long retired[NUMCOUNTERS];
+
+// Key to be notified when threads finish.
+static pthread_once_t shardOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t shardKey;
+
+// Retire the shard of a finishing thread.
+static void InstrLeave(void* p) {
+  InstrShard* shard = (InstrShard*)p;
+  pthread_mutex_lock(&shardLock);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    retired[i] += shard->count[i];
+  InstrShard** q = &shards;
+  while (*q != shard) q = &(*q)->next;
+  *q = shard->next;
+  shard->joined = 0;
+  pthread_mutex_unlock(&shardLock);
+}
+
+static void InstrMakeKey(void) {
+  pthread_key_create(&shardKey, InstrLeave);
+}
+
+/// Start using the shard of the running thread.  Returns its counters.
+unsigned long* InstrJoin(void) { ///
+  InstrShard* shard = &InstrMyShard;
+  pthread_once(&shardOnce, InstrMakeKey);
+  pthread_mutex_lock(&shardLock);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    shard->count[i] = 0ul;
+  shard->next = shards;
+  shards = shard;
+  shard->joined = 1;
+  pthread_mutex_unlock(&shardLock);
+  pthread_setspecific(shardKey, shard);
+  return shard->count;
+}
+
+#endif
+
+/// Number of pixels processed since reset, set by the client.
+unsigned long InstrPixels;  ///extern
+
+// Hardware counters.
+//
+// Each event is opened on its own (not as a group), so that events the
+// PMU lacks do not disable the others, and inherited by new threads.
+// If there are more events than hardware counters, the kernel multiplexes
+// them, so values are scaled by time enabled / time running.
+// Counters are never reset: InstrReset stores their values as baselines.
+
+enum { HW_CYCLES, HW_INSTR, HW_L1DMISS, HW_LLCMISS, HW_BRMISS, HW_DTLBMISS, NUMHW };
+
+static const char* hwName[NUMHW] = {
+  "cycles", "instructions", "L1D-misses", "LLC-misses", "branch-misses", "dTLB-misses"
+};
+
+static int hwEnabled = 0;        // was InstrHWEnable called successfully?
+static int hwFd[NUMHW];          // file descriptors (-1 if not available)
+static double hwBase[NUMHW];     // values at reset
+
+#ifdef __linux__
+
+#define CACHE_MISS(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static int HWOpen(int type, unsigned long long config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Read (scaled) value of hardware counter e, or -1 if not available.
+static double HWRead(int e) {
+  unsigned long long v[3];  // value, time enabled, time running
+  if (hwFd[e] < 0 || read(hwFd[e], v, sizeof(v)) != sizeof(v)) return -1.0;
+  if (v[2] == 0) return 0.0;
+  return (double)v[0] * ((double)v[1] / (double)v[2]);
+}
+
+#endif
+
+int InstrHWEnable(void) { ///
+  int n = 0;
+#ifdef __linux__
+  if (hwEnabled) {
+    for (int e = 0; e < NUMHW; e++) n += hwFd[e] >= 0;
+    return n;
+  }
+  hwFd[HW_CYCLES] = HWOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  hwFd[HW_INSTR] = HWOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  hwFd[HW_L1DMISS] = HWOpen(PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D));
+  hwFd[HW_LLCMISS] = HWOpen(PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL));
+  hwFd[HW_BRMISS] = HWOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  hwFd[HW_DTLBMISS] = HWOpen(PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB));
+  for (int e = 0; e < NUMHW; e++) {
+    n += hwFd[e] >= 0;
+    hwBase[e] = HWRead(e);
+  }
+  hwEnabled = n > 0;
+#endif
+  return n;
+}
+
+/// Get the current value of each counter into total[NUMCOUNTERS]
+/// (summed over all shards).
+void InstrTotal(unsigned long* total) { ///
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    total[i] = InstrCount[i];
+#ifdef INSTR_SHARDED
+  pthread_mutex_lock(&shardLock);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    total[i] += retired[i];
+  for (InstrShard* shard = shards; shard != NULL; shard = shard->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      total[i] += shard->count[i];
+  pthread_mutex_unlock(&shardLock);
+#endif
+}
+
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
+/// Wall_time read on previous reset (~seconds)
+double InstrWallTime;  ///extern
+
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
-/// Find the Calibrated Time Unit (CTU).
-/// Run and time a loop of basic memory and arithmetic operations to set
-/// a reasonably cpu-independent time unit.
-void InstrCalibrate(void) { ///
+// Calibration.
+//
+// The CTU is the cpu time of CALLOOP iterations of the loop in CalLoop.
+// Running them all takes a significant time, which varies with the load
+// of the machine.  Instead, CALBURSTS bursts of CALLOOP/CALSCALE
+// iterations are timed, and the fastest one, scaled, is the CTU.
+// The fastest burst is the one least disturbed by other processes.
+#define CALLOOP 40000000
+#define CALSCALE 64
+#define CALBURSTS 5
+
+static int calPending = 0;  // should InstrPrint calibrate first?
+
+// Run n iterations of the calibration loop.
+static void CalLoop(int n) {
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
   int array[size];  // alloc array in stack, not initialized on purpose
-  double time = cpu_time();
-  srand((unsigned int)(time*1e9));
-  for (int n = 0; n < 40000000; n++) {
+  for (int it = 0; it < n; it++) {
     int i = rand() & mask;
     int j = rand() & mask;
     int k = rand() & mask;
     array[k] ^= array[i] + array[j] + i*j;
     //printf("%d %d %d\n", i, j, k);  // debug
   }
-  InstrCTU = cpu_time() - time;
 }
 
-/// Reset counters to zero and store cpu_time.
+// Get the cpu model name into model (size bytes), as a cache key.
+static void CalModel(char* model, size_t size) {
+  snprintf(model, size, "unknown");
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) return;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* colon = strchr(line, ':');
+    if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+      snprintf(model, size, "%s", colon + 2);
+      model[strcspn(model, "\n")] = '\0';
+      break;
+    }
+  }
+  fclose(f);
+}
+
+// Get the name of the cache file into path (size bytes).
+// Returns 0 if there is none (the cache is opt-in: nothing is written
+// unless INSTR_CTU_CACHE names a file).
+static int CalCachePath(char* path, size_t size) {
+  const char* cache = getenv("INSTR_CTU_CACHE");
+  if (cache == NULL || cache[0] == '\0') return 0;
+  return snprintf(path, size, "%s", cache) < (int)size;
+}
+
+// Look up the CTU of model in the cache file.  Returns 0 if not found.
+// Each line of the file is: CTU<tab>model.
+static double CalCacheGet(const char* path, const char* model) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return 0.0;
+  double ctu = 0.0;
+  char line[320];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* tab = strchr(line, '\t');
+    if (tab == NULL) continue;
+    tab[1 + strcspn(tab + 1, "\n")] = '\0';
+    if (strcmp(tab + 1, model) == 0) ctu = atof(line);
+  }
+  fclose(f);
+  return ctu > 0.0 ? ctu : 0.0;
+}
+
+// Add the CTU of model to the cache file (in a single write, so that
+// concurrent processes do not mix lines).  Errors are ignored.
+static void CalCachePut(const char* path, const char* model, double ctu) {
+  FILE* f = fopen(path, "a");
+  if (f == NULL) return;
+  char line[320];
+  snprintf(line, sizeof(line), "%.9f\t%s\n", ctu, model);
+  fputs(line, f);
+  fclose(f);
+}
+
+/// Find the Calibrated Time Unit (CTU).
+/// Run and time a loop of basic memory and arithmetic operations to set
+/// a reasonably cpu-independent time unit.
+void InstrCalibrate(void) { ///
+  calPending = 0;
+  const char* env = getenv("INSTR_CTU");
+  if (env != NULL && atof(env) > 0.0) {
+    InstrCTU = atof(env);
+    return;
+  }
+  char model[256];
+  char path[1024];
+  CalModel(model, sizeof(model));
+  int cached = CalCachePath(path, sizeof(path));
+  if (cached) {
+    double ctu = CalCacheGet(path, model);
+    if (ctu > 0.0) {
+      InstrCTU = ctu;
+      return;
+    }
+  }
+  srand((unsigned int)(cpu_time()*1e9));
+  double best = -1.0;
+  for (int b = 0; b < CALBURSTS; b++) {
+    double time = cpu_time();
+    CalLoop(CALLOOP / CALSCALE);
+    time = cpu_time() - time;
+    if (best < 0.0 || time < best) best = time;
+  }
+  InstrCTU = best * CALSCALE;
+  if (cached && InstrCTU > 0.0) CalCachePut(path, model, InstrCTU);
+}
+
+/// Call InstrCalibrate when the CTU is first needed (in InstrPrint),
+/// instead of now.
+void InstrCalibrateLazy(void) { ///
+  calPending = 1;
+}
+
+/// Reset counters to zero and store cpu_time and wall_time.
 void InstrReset(void) { ///
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+#ifdef INSTR_SHARDED
+  pthread_mutex_lock(&shardLock);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    retired[i] = 0ul;
+  for (InstrShard* shard = shards; shard != NULL; shard = shard->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      shard->count[i] = 0ul;
+  pthread_mutex_unlock(&shardLock);
+#endif
+  InstrPixels = 0ul;
+#ifdef __linux__
+  for (int e = 0; hwEnabled && e < NUMHW; e++)
+    hwBase[e] = HWRead(e);
+#endif
+  InstrWallTime = wall_time();
   InstrTime = cpu_time();
 }
 
 // Print times and all named counter values
+// (summed over all shards).
 void InstrPrint(void) { ///
+  unsigned long total[NUMCOUNTERS];
+  InstrTotal(total);
+  // hardware counts since last reset (-1 if not available):
+  double hw[NUMHW];
+  for (int e = 0; e < NUMHW; e++) {
+    hw[e] = -1.0;
+#ifdef __linux__
+    if (hwEnabled && hwFd[e] >= 0) hw[e] = HWRead(e) - hwBase[e];
+#endif
+  }
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  double walltime = wall_time() - InstrWallTime;
+  if (calPending) {
+    // calibrate now, but do not charge it to the times since reset:
+    double cpu0 = cpu_time();
+    double wall0 = wall_time();
+    InstrCalibrate();
+    InstrTime += cpu_time() - cpu0;
+    InstrWallTime += wall_time() - wall0;
+  }
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
+  printf("#%14.15s\t%15.15s\t%15.15s", "time", "caltime", "walltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  if (hwEnabled) {
+    for (int e = 0; e < NUMHW; e++)
+      printf("\t%15.15s", hwName[e]);
+    printf("\t%15.15s", "IPC");
+    if (InstrPixels > 0) printf("\t%15.15s", "cycles/pixel");
+  }
   puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+  printf("%15.6f\t%15.6f\t%15.6f", time, caltime, walltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", total[i]);  
+  if (hwEnabled) {
+    for (int e = 0; e < NUMHW; e++)
+      if (hw[e] >= 0.0) printf("\t%15.0f", hw[e]); else printf("\t%15s", "-");
+    if (hw[HW_CYCLES] > 0.0 && hw[HW_INSTR] >= 0.0)
+      printf("\t%15.3f", hw[HW_INSTR] / hw[HW_CYCLES]);
+    else
+      printf("\t%15s", "-");
+    if (InstrPixels > 0) {
+      if (hw[HW_CYCLES] >= 0.0)
+        printf("\t%15.3f", hw[HW_CYCLES] / (double)InstrPixels);
+      else
+        printf("\t%15s", "-");
+    }
+  }
   puts("");
 }
 
@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Call once, to measure CTU (or InstrCalibrateLazy())
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,6 +18,19 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Counting modes, selected at compile time:
+///
+/// InstrCounter(i) is the counter to increment, as in
+///   InstrCounter(0) += 3;
+/// By default, it is InstrCount[i], as above.  That is the cheapest way to
+/// count, but increments from concurrent threads may be lost.
+/// With -DINSTR_SHARDED, each thread increments its own shard of counters,
+/// in its own cache line, so threads neither race nor contend.
+/// InstrPrint adds up the shards (including those of finished threads).
+/// With -DINSTR_OFF, InstrCounter(i) += n compiles to nothing.
+/// (InstrCount may still be used directly in any mode.)
+/// All modules must be compiled in the same mode.
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
@@ -25,6 +38,11 @@
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock (monotonic) time in seconds.
+/// Unlike cpu_time, which adds up the time of all threads, it measures
+/// the latency of an operation.
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
@@ -34,21 +52,88 @@ extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
 
+#if defined(INSTR_OFF)
+
+// A fresh temporary: stores to it are optimized away.
+#define InstrCounter(i) (*(unsigned long[1]){0ul})
+
+#elif defined(INSTR_SHARDED)
+
+/// A shard of counters, owned by one thread.
+typedef struct InstrShard {
+  unsigned long count[NUMCOUNTERS];
+  struct InstrShard* next;  // next shard in use
+  int joined;               // is it in use?
+} __attribute__((aligned(64))) InstrShard;
+
+/// The shard of the running thread.
+extern __thread InstrShard InstrMyShard;  ///extern
+
+/// Start using the shard of the running thread.  Returns its counters.
+unsigned long* InstrJoin(void) ;
+
+static inline unsigned long* InstrShardCount(void) {
+  return InstrMyShard.joined ? InstrMyShard.count : InstrJoin();
+}
+
+#define InstrCounter(i) (InstrShardCount()[i])
+
+#else
+
+#define InstrCounter(i) (InstrCount[i])
+
+#endif
+
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
+/// Wall_time read on previous reset (~seconds)
+extern double InstrWallTime;  ///extern
+
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// To save time, the CTU may be given in environment variable INSTR_CTU
+/// (in seconds), or else it is looked up, by cpu model, in the cache file
+/// named by environment variable INSTR_CTU_CACHE (if set and not empty).
+/// Only if it is not found there, the loop is run (in short bursts, of
+/// which the fastest is taken), and its result saved to the cache file.
+/// (There is no cache file by default: nothing is written unless asked.)
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Call InstrCalibrate when the CTU is first needed (in InstrPrint),
+/// instead of now.  Programs that never print times never calibrate.
+void InstrCalibrateLazy(void) ;
+
+/// Reset counters to zero and store cpu_time and wall_time.
 void InstrReset(void) ;
 
+/// Get the current value of each counter into total[NUMCOUNTERS]
+/// (in any counting mode).
+void InstrTotal(unsigned long* total) ;
+
+/// Print times and counters.
 void InstrPrint(void) ;
 
+/// Hardware counters
+
+/// Number of pixels processed since reset, set by the client.
+/// If nonzero, InstrPrint shows the cycles per pixel.
+extern unsigned long InstrPixels;  ///extern
+
+/// Enable hardware performance counters (Linux perf_event_open):
+/// cycles, instructions, L1D, LLC, branch and dTLB misses, counted in user
+/// mode for this thread and the threads it creates from now on.
+/// Then, InstrReset resets them too, and InstrPrint shows them as extra
+/// columns, with instructions per cycle (IPC), and cycles per pixel.
+/// Counters that the system does not provide are shown as "-".
+/// Returns the number of counters available: 0 if perf_event_open is not
+/// supported or not permitted (see /proc/sys/kernel/perf_event_paranoid),
+/// in which case InstrPrint shows only the usual columns.
+int InstrHWEnable(void) ;
+
 #endif
 